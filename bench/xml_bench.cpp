@@ -0,0 +1,910 @@
+// Benchmarks for xml_io.h
+//
+// Build (one translation unit, no other dependencies):
+//	cl /std:c++17 /O2 /EHsc /utf-8 xml_bench.cpp
+//
+// Usage:
+//	xml_bench [-sizes 1K,64K,1M,16M] [-dir <folder for corpus files>] [-out result.json]
+//	xml_bench -check	correctness checks of the parser, exit code 1 on failure
+//	xml_bench -stress [4.5G] [-dir <folder>]	round trip of a document with offsets past 4G,
+//		needs several times its size in memory
+//
+// Corpus is generated deterministically, so results of two builds are comparable.
+// Every shape is written as UTF-8 and UTF-16 LE, both with BOM.
+
+#include "../xml_io.h"
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<unsigned long long> g_allocCount( 0 );
+static std::atomic<unsigned long long> g_allocBytes( 0 );
+static volatile size_t g_sink = 0; // keeps results of benchmarks alive
+
+void* operator new( size_t size ){
+	++g_allocCount;
+	g_allocBytes += size;
+	if( void* p = malloc( size ? size : 1 ) ) return p;
+	throw std::bad_alloc();
+}
+void* operator new[]( size_t size ){ return operator new( size ); }
+void operator delete( void* p ) noexcept { free( p ); }
+void operator delete[]( void* p ) noexcept { free( p ); }
+void operator delete( void* p, size_t ) noexcept { free( p ); }
+void operator delete[]( void* p, size_t ) noexcept { free( p ); }
+
+enum class CorpusShape : unsigned int{
+	Wide,		// many small records
+	Deep,		// long chains of nested elements
+	Attributes,	// 16 attributes per element
+	Text,		// long text content
+	Entities,	// text and values full of &...;
+	NONE
+};
+const char* corpusShapeName( CorpusShape s ){
+	switch( s ){
+	case CorpusShape::Wide: return "wide";
+	case CorpusShape::Deep: return "deep";
+	case CorpusShape::Attributes: return "attributes";
+	case CorpusShape::Text: return "text";
+	case CorpusShape::Entities: return "entities";
+	default: break;
+	}
+	return "none";
+}
+// XPath that selects the main repeated element of the shape
+const char16_t* corpusShapeXPath( CorpusShape s ){
+	switch( s ){
+	case CorpusShape::Wide: return u"/Root/Record";
+	case CorpusShape::Deep: return u"/Root/Level/Level";
+	case CorpusShape::Attributes: return u"/Root/Item";
+	case CorpusShape::Text: return u"/Root/Para";
+	case CorpusShape::Entities: return u"/Root/Entry";
+	default: break;
+	}
+	return u"/Root";
+}
+
+// xorshift, fixed seed
+struct CorpusRandom{
+	unsigned long long m_state = 0x9E3779B97F4A7C15ull;
+	unsigned int next(){
+		m_state ^= m_state << 13;
+		m_state ^= m_state >> 7;
+		m_state ^= m_state << 17;
+		return (unsigned int)(m_state >> 32);
+	}
+	unsigned int range( unsigned int n ){ return next() % n; }
+};
+
+void corpusAppendNumber( kkXMLString& out, unsigned long long n ){
+	char buf[ 32 ];
+	int sz = snprintf( buf, sizeof(buf), "%llu", n );
+	for( int i = 0; i < sz; ++i ) out += (char16_t)buf[ i ];
+}
+void corpusAppendWord( kkXMLString& out, CorpusRandom& rnd ){
+	// mix of ASCII, Latin-1 and Cyrillic, all below 0x800
+	static const char16_t* words[] = {
+		u"alpha", u"beta", u"gamma", u"delta", u"café", u"naïve",
+		u"данные", u"файл", u"value", u"item"
+	};
+	out += words[ rnd.range( 10 ) ];
+}
+void corpusAppendEntity( kkXMLString& out, CorpusRandom& rnd ){
+	static const char16_t* ents[] = { u"&amp;", u"&lt;", u"&gt;", u"&quot;", u"&apos;" };
+	out += ents[ rnd.range( 5 ) ];
+}
+
+void generateCorpus( CorpusShape shape, size_t targetSize, kkXMLString& out ){
+	CorpusRandom rnd;
+	out.clear();
+	out.reserve( targetSize + 1024 );
+	out += u"<?xml version=\"1.0\"?>\r\n<Root>\r\n";
+	unsigned long long n = 0;
+	while( out.size() < targetSize ){
+		switch( shape ){
+		case CorpusShape::Wide:
+			out += u"\t<Record id=\"";
+			corpusAppendNumber( out, n );
+			out += u"\">\r\n\t\t<Name>";
+			corpusAppendWord( out, rnd );
+			out += u"</Name>\r\n\t\t<Value>";
+			corpusAppendNumber( out, rnd.next() );
+			out += u"</Value>\r\n\t</Record>\r\n";
+			break;
+		case CorpusShape::Deep:{
+			const unsigned int depth = 64;
+			for( unsigned int i = 0; i < depth; ++i ){
+				out += u"<Level id=\"";
+				corpusAppendNumber( out, n * depth + i );
+				out += u"\">";
+			}
+			corpusAppendWord( out, rnd );
+			for( unsigned int i = 0; i < depth; ++i ){
+				out += u"</Level>";
+			}
+			out += u"\r\n";
+		}break;
+		case CorpusShape::Attributes:
+			out += u"\t<Item id=\"";
+			corpusAppendNumber( out, n );
+			out += u"\"";
+			for( unsigned int i = 0; i < 16; ++i ){
+				out += u" a";
+				corpusAppendNumber( out, i );
+				out += u"=\"";
+				corpusAppendWord( out, rnd );
+				out += u"\"";
+			}
+			out += u"/>\r\n";
+			break;
+		case CorpusShape::Text:{
+			out += u"\t<Para id=\"";
+			corpusAppendNumber( out, n );
+			out += u"\">";
+			unsigned int words = 64 + rnd.range( 192 );
+			for( unsigned int i = 0; i < words; ++i ){
+				if( i ) out += u" ";
+				corpusAppendWord( out, rnd );
+			}
+			out += u"</Para>\r\n";
+		}break;
+		case CorpusShape::Entities:{
+			out += u"\t<Entry id=\"";
+			corpusAppendNumber( out, n );
+			out += u"\" key=\"";
+			corpusAppendEntity( out, rnd );
+			corpusAppendWord( out, rnd );
+			corpusAppendEntity( out, rnd );
+			out += u"\">";
+			for( unsigned int i = 0; i < 16; ++i ){
+				corpusAppendWord( out, rnd );
+				corpusAppendEntity( out, rnd );
+			}
+			out += u"</Entry>\r\n";
+		}break;
+		default:
+			return;
+		}
+		++n;
+	}
+	out += u"</Root>\r\n";
+}
+
+bool saveCorpus( const kkXMLString& fileName, kkXMLString& text, bool utf8 ){
+	kkPtr<kkFile> out = xmlutil::createFileForWriteBin( fileName );
+	if( !out.ptr() ) return false;
+	if( utf8 ){
+		kkXMLStringA mbstr;
+		xmlutil::string_UTF16_to_UTF8( text, mbstr );
+		out->write( (unsigned char*)"\xEF\xBB\xBF", 3 );
+		out->write( (unsigned char*)mbstr.data(), mbstr.size() );
+	}else{
+		out->write( (unsigned char*)"\xFF\xFE", 2 );
+		out->write( (unsigned char*)text.data(), text.size() * sizeof(char16_t) );
+	}
+	return true;
+}
+
+unsigned long long peakRSS(){
+	PROCESS_MEMORY_COUNTERS pmc;
+	if( GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof(pmc) ) )
+		return (unsigned long long)pmc.PeakWorkingSetSize;
+	return 0;
+}
+
+struct BenchResult{
+	double seconds = 0.0;      // best iteration
+	unsigned long long allocs = 0;     // per iteration
+	unsigned long long allocBytes = 0; // per iteration
+};
+
+// Runs `f` several times, keeps fastest time and allocations of last run.
+template<typename F>
+BenchResult runBench( size_t bytes, F f ){
+	BenchResult r;
+	unsigned int iterations = 1;
+	if( bytes < (64u << 20) ) iterations = (unsigned int)((64u << 20) / (bytes ? bytes : 1));
+	if( iterations > 20 ) iterations = 20;
+	if( iterations < 3 ) iterations = 3;
+	r.seconds = 1e30;
+	for( unsigned int i = 0; i < iterations; ++i ){
+		unsigned long long a = g_allocCount;
+		unsigned long long b = g_allocBytes;
+		auto t0 = std::chrono::steady_clock::now();
+		f();
+		auto t1 = std::chrono::steady_clock::now();
+		double s = std::chrono::duration<double>( t1 - t0 ).count();
+		if( s < r.seconds ) r.seconds = s;
+		r.allocs = g_allocCount - a;
+		r.allocBytes = g_allocBytes - b;
+	}
+	return r;
+}
+
+struct BenchOutput{
+	kkXMLStringA m_json;
+	bool m_first = true;
+	void add( const char* name, CorpusShape shape, bool utf8, size_t bytes, const BenchResult& r ){
+		char buf[ 512 ];
+		double mbs = r.seconds > 0.0 ? ((double)bytes / (1024.0 * 1024.0)) / r.seconds : 0.0;
+		snprintf( buf, sizeof(buf),
+			"%s\n    {\"bench\": \"%s\", \"shape\": \"%s\", \"encoding\": \"%s\", \"bytes\": %llu, "
+			"\"seconds\": %.9f, \"mb_per_s\": %.3f, \"allocs\": %llu, \"alloc_bytes\": %llu, \"peak_rss\": %llu}",
+			m_first ? "" : ",", name, corpusShapeName( shape ), utf8 ? "utf-8" : "utf-16",
+			(unsigned long long)bytes, r.seconds, mbs, r.allocs, r.allocBytes, peakRSS() );
+		m_json += buf;
+		m_first = false;
+		fprintf( stderr, "%-18s %-10s %-6s %12llu bytes %10.3f MB/s %10llu allocs\n",
+			name, corpusShapeName( shape ), utf8 ? "utf-8" : "utf-16", (unsigned long long)bytes, mbs, r.allocs );
+	}
+};
+
+size_t parseSize( const char* s ){
+	char* end = nullptr;
+	double v = strtod( s, &end );
+	if( end ){
+		if( *end == 'K' || *end == 'k' ) v *= 1024.0;
+		else if( *end == 'M' || *end == 'm' ) v *= 1024.0 * 1024.0;
+		else if( *end == 'G' || *end == 'g' ) v *= 1024.0 * 1024.0 * 1024.0;
+	}
+	return (size_t)v;
+}
+
+// -check
+static unsigned int g_failed = 0;
+#define CHECK(x) do{ if( !(x) ){ fprintf( stderr, "check failed, line %d: %s\n", __LINE__, #x ); ++g_failed; } }while(0)
+
+// Moved documents keep their tree, indexes and settings.
+void checkMove(){
+	kkXMLString x( u"<R><Item id='a'/><Item id='b'><Sub/></Item><G><Item id='c'/></G></R>" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	a.AddAttributeIndex( u"id" );
+	kkArray<kkXMLNode*> nodes;
+	kkXMLDocument b( std::move( a ) );
+	CHECK( b.GetRootNode()->nodeList.size() == 3 );
+	b.SelectNodes( u"//Item", nodes );
+	CHECK( nodes.size() == 3 );
+	CHECK( b.GetElementById( u"c" ) && b.GetElementById( u"c" )->parent->name == u"G" );
+	kkXMLDocument c;
+	kkXMLString y( u"<Q><C/></Q>" );
+	CHECK( c.ParseBuffer( y.data(), y.size() ) );
+	c = std::move( b );
+	CHECK( c.GetRootNode()->name == u"R" && c.GetRootNode()->nodeList.size() == 3 );
+	c.SelectNodes( u"/R/Item", nodes );
+	CHECK( nodes.size() == 2 );
+	std::vector<kkXMLDocument> docs;
+	for( unsigned int i = 0; i < 9; ++i ){
+		docs.emplace_back();
+		CHECK( docs.back().ParseBuffer( x.data(), x.size() ) );
+	}
+	for( auto& d : docs ){
+		d.SelectNodes( u"//Item", nodes );
+		CHECK( d.GetRootNode()->nodeList.size() == 3 && nodes.size() == 3 );
+	}
+	CHECK( a.ParseBuffer( y.data(), y.size() ) && a.GetRootNode()->nodeList.size() == 1 );
+}
+
+// Write copies the prolog of a parsed document, with the declared encoding
+// changed to the one that is written.
+void checkProlog(){
+	const kkXMLString file( u"xml_bench_check.xml" );
+	kkXMLString x( u"<?xml version='1.0' encoding='windows-1252' standalone='yes'?>\r\n<R><A/></R>" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	kkXMLString text;
+	a.Write( file, true );
+	CHECK( xmlutil::readTextFromFileForUnicode( file, text ) );
+	CHECK( text.find( u"<?xml version='1.0' encoding='UTF-8' standalone='yes'?>\r\n<R>" ) != kkXMLString::npos );
+	a.Write( file, false );
+	CHECK( xmlutil::readTextFromFileForUnicode( file, text ) );
+	CHECK( text.find( u"<?xml version='1.0' encoding='UTF-16' standalone='yes'?>\r\n<R>" ) != kkXMLString::npos );
+	kkXMLString y( u"<?xml version=\"1.0\" encoding=\"utf-8\"?><R/>" );
+	CHECK( a.ParseBuffer( y.data(), y.size() ) );
+	a.Write( file, true );
+	CHECK( xmlutil::readTextFromFileForUnicode( file, text ) );
+	CHECK( text.find( y ) != kkXMLString::npos );
+	std::filesystem::remove( file );
+}
+
+// Decoded text and attribute values are never taken for markup.
+void checkEntityText(){
+	kkXMLDocument a;
+	const char16_t* entities[] = { u"&gt;", u"&lt;", u"&quot;", u"&lt;/a&gt;" };
+	const char16_t* texts[] = { u">", u"<", u"\"", u"</a>" };
+	for( unsigned int i = 0; i < 4; ++i ){
+		kkXMLString x = kkXMLString( u"<a>" ) + entities[ i ] + u"</a>";
+		CHECK( a.ParseBuffer( x.data(), x.size() ) && a.GetRootNode()->text == texts[ i ] );
+		x = kkXMLString( u"<a><b/>" ) + entities[ i ] + u"<c x='" + entities[ i ] + u"'/></a>";
+		CHECK( a.ParseBuffer( x.data(), x.size() ) && a.GetRootNode()->nodeList.size() == 2 );
+		CHECK( a.GetRootNode()->nodeList.size() == 2 && a.GetRootNode()->nodeList[ 1 ]->attributeList[ 0 ]->value == texts[ i ] );
+	}
+	kkXMLString x( u"<a><b>&gt;</b><b>&lt;</b></a>" );
+	kkXMLStringA json;
+	CHECK( a.TranscodeJSON( x.data(), x.size(), [&]( const char* data, size_t size ){ json.append( data, size ); } ) );
+	CHECK( json == "{\"a\":{\"b\":[\">\",\"<\"]}}" );
+}
+
+// Compressed input that can not be read is reported by error code.
+void checkCompressed(){
+	const kkXMLString file( u"xml_bench_check.xml" );
+	const char* data[] = {
+		"\x28\xB5\x2F\xFD\x00\x00\x00\x00",        // zstd
+		"\x1F\x8B\x08\x00\x00\x00\x00\x00\x00\x03", // gzip header only
+	};
+	size_t size[] = { 8, 10 };
+	kkXMLErrorCode code[] = { kkXMLErrorCode::UnsupportedCompression, kkXMLErrorCode::BadCompressedData };
+	for( unsigned int i = 0; i < 2; ++i ){
+		{
+			kkPtr<kkFile> out = xmlutil::createFileForWriteBin( file );
+			out->write( (unsigned char*)data[ i ], size[ i ] );
+		}
+		kkXMLDocument a;
+		CHECK( !a.ReadFile( file ) && a.GetError().code == code[ i ] && a.GetText().empty() );
+	}
+	std::filesystem::remove( file );
+}
+
+// XML to JSON: runs of one name are arrays, file input read in windows
+// gives the same JSON as text in memory.
+void checkJSON(){
+	kkXMLDocument a;
+	kkXMLStringA json;
+	auto sink = [&]( const char* data, size_t size ){ json.append( data, size ); };
+	kkXMLString x( u"<R><a><b>1</b><b>2</b></a><a><b>3</b></a><c/><a/></R>" );
+	CHECK( a.TranscodeJSON( x.data(), x.size(), sink ) );
+	CHECK( json == "{\"R\":{\"a\":[{\"b\":[\"1\",\"2\"]},{\"b\":\"3\"}],\"c\":null,\"a\":null}}" );
+	kkXMLJSONOptions options;
+	options.holdSize = 8;
+	json.clear();
+	x = u"<R><a>0123456789</a><a>x</a><b>1</b><b>2</b></R>";
+	CHECK( a.TranscodeJSON( x.data(), x.size(), sink, options ) );
+	CHECK( json == "{\"R\":{\"a\":\"0123456789\",\"a\":\"x\",\"b\":[\"1\",\"2\"]}}" );
+	for( unsigned int s = 0; s < (unsigned int)CorpusShape::NONE; ++s ){
+		const kkXMLString file( u"xml_bench_check.xml" );
+		const kkXMLString jsonFile( u"xml_bench_check.json" );
+		generateCorpus( (CorpusShape)s, 3u << 20, x );
+		json.clear();
+		CHECK( a.TranscodeJSON( x.data(), x.size(), sink ) );
+		for( unsigned int e = 0; e < 2; ++e ){
+			CHECK( saveCorpus( file, x, e == 0 ) );
+			CHECK( a.WriteJSON( file, jsonFile ) );
+			kkPtr<kkFile> in = xmlutil::openFileForReadBin( jsonFile );
+			kkXMLStringA fromFile( in.ptr() ? (size_t)in->size() : 0, '\0' );
+			if( fromFile.size() ) in->read( (unsigned char*)fromFile.data(), fromFile.size() );
+			CHECK( fromFile == json );
+		}
+		// output is checked, and not truncated when input can not be read
+		CHECK( !a.WriteJSON( file, u"xml_bench_missing/out.json" ) && a.GetError().code == kkXMLErrorCode::FileWrite );
+		std::filesystem::remove( file );
+		CHECK( !a.WriteJSON( file, jsonFile ) && a.GetError().code == kkXMLErrorCode::FileRead );
+		CHECK( std::filesystem::file_size( jsonFile ) == json.size() );
+		std::filesystem::remove( jsonFile );
+	}
+}
+
+// Numbers are read in xsd:double forms only, out of range is an error.
+void checkNumbers(){
+	double d = 0.0;
+	float f = 0.0f;
+	CHECK( xmlutil::parseValue( kkXMLString( u" 1.5 " ), d ) && d == 1.5 );
+	CHECK( xmlutil::parseValue( kkXMLString( u"+.5" ), d ) && d == 0.5 );
+	CHECK( xmlutil::parseValue( kkXMLString( u"5." ), d ) && d == 5.0 );
+	CHECK( xmlutil::parseValue( kkXMLString( u"12345678901234567890123e-3" ), d ) && d == 12345678901234567890.123 );
+	CHECK( xmlutil::parseValue( kkXMLString( u"-2.5e300" ), d ) && d == -2.5e300 );
+	CHECK( xmlutil::parseValue( kkXMLString( u"-INF" ), d ) && d == -std::numeric_limits<double>::infinity() );
+	CHECK( xmlutil::parseValue( kkXMLString( u"NaN" ), d ) && d != d );
+	d = 7.0;
+	const char16_t* bad[] = { u"", u".", u"1e", u"1,5", u"1e400", u"1e-400", u"inf", u"nan", u"-NaN", u"Infinity", u"0x1p3", u"1.5f" };
+	for( const char16_t* text : bad ) CHECK( !xmlutil::parseValue( kkXMLString( text ), d ) && d == 7.0 );
+	CHECK( xmlutil::parseValue( kkXMLString( u"3.4e38" ), f ) && f == 3.4e38f );
+	CHECK( !xmlutil::parseValue( kkXMLString( u"1e39" ), f ) );
+}
+
+// Bad XPath is reported in GetError, nothing is printed.
+void checkXPathErrors(){
+	kkXMLString x( u"<R><Item id='a'/></R>" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	kkArray<kkXMLNode*> nodes;
+	kkXPathValue value;
+	const char16_t* paths[] = { u"R/Item", u"/R/", u"/R/Item[@id]", u"/R | ", u"/R/'a", u"/R!" };
+	for( const char16_t* path : paths ){
+		CHECK( !a.SelectNodes( path, nodes ) && a.GetError().code == kkXMLErrorCode::BadXPath && a.GetError().found == path );
+	}
+	size_t line, col;
+	CHECK( !a.GetErrorPosition( line, col ) );
+	CHECK( !a.Select( u"/R/!" ).first() && a.GetError().code == kkXMLErrorCode::BadXPath );
+	const char16_t* functions[] = { u"/R/Item", u"avg(/R/Item)", u"string(/R/@)" };
+	for( const char16_t* function : functions )
+		CHECK( !a.Evaluate( function, value ) && a.GetError().code == kkXMLErrorCode::BadXPath && a.GetError().found == function );
+	CHECK( a.Evaluate( u"count(/R/Item)", value ) && value.number == 1.0 );
+	kkXMLFrozenDocument frozen;
+	CHECK( a.Freeze( frozen ) );
+	kkArray<kkXMLHandle> handles;
+	kkXMLError error;
+	CHECK( !frozen.SelectNodes( u"/R | ", handles, &error ) && error.code == kkXMLErrorCode::BadXPath && error.offset == 5 );
+	CHECK( frozen.SelectNodes( u"/R/Item", handles ) && handles.size() == 1 );
+}
+
+// Lazy Select of a union gives the nodes of SelectNodes, in document order.
+void checkSelectUnion(){
+	kkXMLString x( u"<R><A><B id='1'/></A><B id='2'><C/></B><A><C/><B id='3'/></A></R>" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	const char16_t* paths[] = { u"//C | /R/A", u"/R/A/B | //B", u"//B[@id='3'] | /R/B | /R/X", u"//C|//A|//B", u"/R/A/B" };
+	kkArray<kkXMLNode*> nodes, lazy;
+	for( unsigned int pass = 0; pass < 2; ++pass ){
+		for( const char16_t* path : paths ){
+			CHECK( a.SelectNodes( path, nodes ) );
+			a.Select( path ).toArray( lazy );
+			CHECK( lazy == nodes );
+		}
+		// order numbers are renewed for the changed tree
+		a.GetRootNode()->insertNode( kkCreate(kkXMLNode)( u"B" ), 0 );
+	}
+	CHECK( a.Select( u"//C | //B" ).take( 2 ).count() == 2 );
+	CHECK( !a.Select( u"/R | /R/!" ).any() && a.GetError().code == kkXMLErrorCode::BadXPath );
+	CHECK( !a.Select( u"/R | " ).any() && a.GetError().code == kkXMLErrorCode::BadXPath );
+}
+
+// Range of nodes() keeps its name, a temporary string does not dangle.
+void checkChildRange(){
+	kkXMLString x( u"<R><Item/><B/><Item/></R>" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	auto items = a.GetRootNode()->nodes( kkXMLString( u"Item" ) );
+	kkXMLString other( u"Overwrites the freed name" );
+	CHECK( items.count() == 2 && other.size() );
+	unsigned int n = 0;
+	for( kkXMLNode* node : a.GetRootNode()->nodes( kkXMLString( u"It" ) + u"em" ) ) n += node->name == u"Item";
+	CHECK( n == 2 );
+}
+
+// Clearing a subtree builds the name and attribute indexes again.
+void checkClearIndexes(){
+	kkXMLString x( u"<Root><A><x id='1'/><x/></A><B><x id='2'/></B></Root>" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	a.AddAttributeIndex( u"id" );
+	kkArray<kkXMLNode*> nodes;
+	CHECK( a.SelectNodes( u"//x", nodes ) && nodes.size() == 3 && a.GetElementById( u"1" ) );
+	a.GetRootNode()->nodeList[ 0 ]->clear();
+	CHECK( a.SelectNodes( u"//x", nodes ) && nodes.size() == 1 );
+	CHECK( !a.GetElementById( u"1" ) && a.GetElementById( u"2" ) );
+}
+
+// Cleared node is written again in its place, ancestors are not copied from source.
+void checkClearWrite(){
+	const kkXMLString file( u"xml_bench_check.xml" );
+	kkXMLString x( u"<Root><A k=\"1\"><x>1</x><x>2</x></A><B/></Root>" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	unsigned long long hash = a.GetHash();
+	kkXMLNode* node = a.GetRootNode()->nodeList[ 0 ];
+	node->clear();
+	node->name = u"A";
+	CHECK( a.GetHash() != hash );
+	kkXMLString text;
+	a.Write( file, true );
+	CHECK( xmlutil::readTextFromFileForUnicode( file, text ) );
+	CHECK( text == u"<Root><A/><B/></Root>" );
+	std::filesystem::remove( file );
+}
+
+// Evaluate of a union counts each node once; unknown tokens in paths are errors.
+void checkEvaluateUnion(){
+	kkXMLString x( u"<Root><A p='1'>5</A><B p='2'>7</B><A p='4'/></Root>" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	kkXPathValue value;
+	CHECK( a.Evaluate( u"count(/Root/A | /Root/B)", value ) && value.number == 3.0 );
+	CHECK( a.Evaluate( u"count(//A | /Root/A)", value ) && value.number == 2.0 );
+	CHECK( a.Evaluate( u"sum(//A/@p | //B/@p)", value ) && value.number == 7.0 );
+	CHECK( a.Evaluate( u"string(//B | //A)", value ) && value.string == u"5" );
+	CHECK( a.Evaluate( u"max(/Root/B | /Root/A[@p='1'])", value ) && value.number == 7.0 );
+	const char16_t* bad[] = { u"sum(//A/@p | //B)", u"sum(//A | //B/@p)", u"count(/Root/A | )", u"count(/Root/A/Root/B*)", u"count(/Root/A,)" };
+	for( const char16_t* path : bad )
+		CHECK( !a.Evaluate( path, value ) && a.GetError().code == kkXMLErrorCode::BadXPath );
+	kkArray<kkXMLNode*> nodes;
+	std::vector<kkXPathToken> tokens;
+	kkArray<kkXPathToken*> elements;
+	CHECK( !xmlutil::XPathGetPath( u"/Root/A | /Root/B", tokens, elements ) );
+	CHECK( !a.SelectNodes( u"/Root/A=1", nodes ) );
+}
+
+// Changed root of a parsed document is written the same on one and on several threads.
+void checkParallelDirtyRoot(){
+	const kkXMLString file( u"xml_bench_check.xml" );
+	kkXMLString x( u"<?xml version=\"1.0\"?>\r\n<R a=\"1\">\r\n\t<A><x>1</x></A>\r\n\t<B/>\r\n\t<C k=\"2\">t</C>\r\n\t<D/>\r\n\ttail\r\n</R>\r\n<!-- end -->" );
+	kkXMLDocument a;
+	CHECK( a.ParseBuffer( x.data(), x.size() ) );
+	a.GetRootNode()->setAttribute( u"a", u"2" );
+	a.GetRootNode()->nodeList[ 2 ]->setText( u"u" );
+	kkXMLString serial, parallel;
+	for( unsigned int utf8 = 0; utf8 < 2; ++utf8 ){
+		a.SetWriteThreads( 1 );
+		a.Write( file, utf8 != 0 );
+		CHECK( xmlutil::readTextFromFileForUnicode( file, serial ) );
+		a.SetWriteThreads( 3 );
+		a.Write( file, utf8 != 0 );
+		CHECK( xmlutil::readTextFromFileForUnicode( file, parallel ) );
+		CHECK( serial == parallel && serial.find( u"<R a=\"2\">" ) != kkXMLString::npos && serial.find( u"<!-- end -->" ) != kkXMLString::npos );
+	}
+	std::filesystem::remove( file );
+}
+
+// Exception from the consumer of readAhead comes out, reading thread is joined.
+void checkReadAheadThrow(){
+	const kkXMLString file( u"xml_bench_check.bin" );
+	kkXMLStringA data( 64u << 10, 'x' );
+	{
+		kkPtr<kkFile> out = xmlutil::createFileForWriteBin( file );
+		CHECK( out->write( (unsigned char*)data.data(), data.size() ) == data.size() );
+	}
+	kkXMLStringA buffer;
+	for( unsigned int at = 0; at < 3; ++at ){
+		kkPtr<kkFile> in = xmlutil::openFileForReadBin( file );
+		unsigned int chunks = 0;
+		bool thrown = false;
+		try{
+			xmlutil::readAhead( in.ptr(), data.size(), 4096, buffer, [&]( const char*, size_t ){
+				if( chunks++ == at * 5 ) throw std::bad_alloc();
+			});
+		}catch( const std::bad_alloc& ){
+			thrown = true;
+		}
+		CHECK( thrown && chunks == at * 5 + 1 );
+	}
+	std::filesystem::remove( file );
+}
+
+// ReadFile of a small file into a reset document does not allocate.
+void checkReadFileReuse(){
+	const kkXMLString file( u"xml_reuse.xml" );
+	kkXMLString x;
+	generateCorpus( CorpusShape::Wide, 64u << 10, x );
+	CHECK( saveCorpus( file, x, true ) );
+	kkXMLDocument a;
+	CHECK( a.ReadFile( file ) );
+	a.Reset();
+	CHECK( a.ReadFile( file ) );
+	a.Reset();
+	unsigned long long allocs = g_allocCount;
+	CHECK( a.ReadFile( file ) );
+	CHECK( g_allocCount == allocs );
+	std::filesystem::remove( file );
+}
+
+int runChecks(){
+	checkMove();
+	checkProlog();
+	checkEntityText();
+	checkCompressed();
+	checkJSON();
+	checkNumbers();
+	checkXPathErrors();
+	checkSelectUnion();
+	checkChildRange();
+	checkClearIndexes();
+	checkClearWrite();
+	checkEvaluateUnion();
+	checkParallelDirtyRoot();
+	checkReadAheadThrow();
+	checkReadFileReuse();
+	fprintf( stderr, g_failed ? "%u checks failed\n" : "all checks passed\n", g_failed );
+	return g_failed ? 1 : 0;
+}
+
+// -stress
+// Text shape written as UTF-8 in parts, so the whole text is never held.
+// Returns size of text after BOM, number of elements and where last Para starts.
+bool saveStressCorpus( const kkXMLString& fileName, size_t targetSize, size_t& textSize, size_t& elements, size_t& lastBegin ){
+	kkPtr<kkFile> out = xmlutil::createFileForWriteBin( fileName );
+	if( !out.ptr() ) return false;
+	out->write( (unsigned char*)"\xEF\xBB\xBF", 3 );
+	CorpusRandom rnd;
+	kkXMLString part( u"<?xml version=\"1.0\"?>\r\n<Root>\r\n" );
+	kkXMLStringA mbstr;
+	textSize = 0;
+	elements = 1;
+	for( unsigned long long n = 0; textSize + part.size() < targetSize; ++n ){
+		part += u"\t";
+		lastBegin = textSize + part.size();
+		part += u"<Para id=\"";
+		corpusAppendNumber( part, n );
+		part += u"\">";
+		unsigned int words = 64 + rnd.range( 192 );
+		for( unsigned int i = 0; i < words; ++i ){
+			if( i ) part += u" ";
+			corpusAppendWord( part, rnd );
+		}
+		part += u"</Para>\r\n";
+		++elements;
+		if( part.size() >= (1u << 20) ){
+			mbstr.clear();
+			xmlutil::string_UTF16_to_UTF8( part, mbstr );
+			out->write( (unsigned char*)mbstr.data(), mbstr.size() );
+			textSize += part.size();
+			part.clear();
+		}
+	}
+	part += u"</Root>\r\n";
+	mbstr.clear();
+	xmlutil::string_UTF16_to_UTF8( part, mbstr );
+	out->write( (unsigned char*)mbstr.data(), mbstr.size() );
+	textSize += part.size();
+	return true;
+}
+size_t countNodes( const kkXMLNode* node ){
+	size_t n = 1;
+	for( const kkXMLNode* child : node->nodeList ) n += countNodes( child );
+	return n;
+}
+// Offsets and counts of a document read from file, written and read again.
+int runStress( size_t size, const kkXMLString& dir ){
+	const kkXMLString file = dir + u"/stress.xml";
+	const kkXMLString copy = dir + u"/stress_copy.xml";
+	size_t textSize = 0;
+	size_t elements = 0;
+	size_t lastBegin = 0;
+	if( !saveStressCorpus( file, size, textSize, elements, lastBegin ) ){
+		fprintf( stderr, "can not write stress.xml\n" );
+		return 1;
+	}
+	fprintf( stderr, "stress: %llu characters, %llu elements, last one at %llu\n",
+		(unsigned long long)textSize, (unsigned long long)elements, (unsigned long long)lastBegin );
+	unsigned long long hash = 0;
+	for( unsigned int pass = 0; pass < 2; ++pass ){
+		kkXMLDocument doc;
+		auto t0 = std::chrono::steady_clock::now();
+		bool ok = doc.ReadFile( pass ? copy : file );
+		auto t1 = std::chrono::steady_clock::now();
+		fprintf( stderr, "%s read in %.3f s\n", pass ? "copy" : "file", std::chrono::duration<double>( t1 - t0 ).count() );
+		CHECK( ok );
+		if( !ok ) break;
+		kkXMLNode* root = doc.GetRootNode();
+		CHECK( doc.GetText().size() == textSize );
+		CHECK( countNodes( root ) == elements );
+		CHECK( root->m_sourceEnd == textSize - 2 );
+		CHECK( root->nodeList.size() == elements - 1 );
+		CHECK( root->nodeList.size() && root->nodeList.back()->m_sourceBegin == lastBegin );
+		CHECK( root->nodeList.size() && root->nodeList.back()->m_pre == elements - 1 );
+		if( pass ){
+			CHECK( doc.GetHash() == hash );
+		}else{
+			hash = doc.GetHash();
+			doc.Write( copy, true );
+		}
+	}
+	std::filesystem::remove( file );
+	std::filesystem::remove( copy );
+	fprintf( stderr, g_failed ? "%u checks failed\n" : "all checks passed\n", g_failed );
+	return g_failed ? 1 : 0;
+}
+
+kkXMLString toXMLString( const char* s ){
+	kkXMLStringA a( s );
+	kkXMLString r;
+	xmlutil::string_UTF8_to_UTF16( r, a );
+	return r;
+}
+
+int main( int argc, char* argv[] ){
+	std::vector<size_t> sizes;
+	kkXMLString dir( u"." );
+	const char* outFile = nullptr;
+	size_t stressSize = 0;
+	for( int i = 1; i < argc; ++i ){
+		kkXMLStringA arg( argv[ i ] );
+		if( arg == "-sizes" && i + 1 < argc ){
+			kkXMLStringA list( argv[ ++i ] );
+			size_t pos = 0;
+			while( pos < list.size() ){
+				size_t comma = list.find( ',', pos );
+				if( comma == kkXMLStringA::npos ) comma = list.size();
+				sizes.push_back( parseSize( list.substr( pos, comma - pos ).c_str() ) );
+				pos = comma + 1;
+			}
+		}else if( arg == "-dir" && i + 1 < argc ){
+			dir = toXMLString( argv[ ++i ] );
+		}else if( arg == "-out" && i + 1 < argc ){
+			outFile = argv[ ++i ];
+		}else if( arg == "-check" ){
+			return runChecks();
+		}else if( arg == "-stress" ){
+			stressSize = (size_t)4608 << 20;
+			if( i + 1 < argc && argv[ i + 1 ][ 0 ] != '-' ) stressSize = parseSize( argv[ ++i ] );
+		}else{
+			fprintf( stderr, "Usage: xml_bench [-sizes 1K,64K,1M,16M] [-dir <folder>] [-out result.json] | -check | -stress [size]\n" );
+			return 1;
+		}
+	}
+	if( stressSize ) return runStress( stressSize, dir );
+	if( !sizes.size() ){
+		sizes.push_back( 1u << 10 );
+		sizes.push_back( 64u << 10 );
+		sizes.push_back( 1u << 20 );
+		sizes.push_back( 16u << 20 );
+	}
+
+	BenchOutput out;
+	kkXMLString corpus;
+	for( size_t size : sizes ){
+		for( unsigned int s = 0; s < (unsigned int)CorpusShape::NONE; ++s ){
+			CorpusShape shape = (CorpusShape)s;
+			generateCorpus( shape, size, corpus );
+
+			// transcoders, on memory only
+			{
+				kkXMLStringA utf8;
+				BenchResult r = runBench( corpus.size() * sizeof(char16_t), [&](){
+					utf8.clear();
+					xmlutil::string_UTF16_to_UTF8( corpus, utf8 );
+				});
+				out.add( "utf16_to_utf8", shape, false, corpus.size() * sizeof(char16_t), r );
+				kkXMLString utf16;
+				r = runBench( utf8.size(), [&](){
+					utf16.clear();
+					xmlutil::string_UTF8_to_UTF16( utf16, utf8 );
+				});
+				out.add( "utf8_to_utf16", shape, true, utf8.size(), r );
+			}
+
+			{
+				BenchResult r = runBench( corpus.size() * sizeof(char16_t), [&](){
+					kkXMLDocument doc;
+					doc.ParseBuffer( corpus.data(), corpus.size() );
+				});
+				out.add( "parse_buffer", shape, false, corpus.size() * sizeof(char16_t), r );
+
+				// same document parsed again and again, allocations should be 0
+				kkXMLDocument doc;
+				r = runBench( corpus.size() * sizeof(char16_t), [&](){
+					doc.Reset();
+					doc.ParseBuffer( corpus.data(), corpus.size() );
+				});
+				out.add( "parse_reuse", shape, false, corpus.size() * sizeof(char16_t), r );
+
+				// streaming XML to JSON, output is counted and dropped
+				size_t jsonSize = 0;
+				auto sink = [&]( const char*, size_t size ){ jsonSize += size; };
+				r = runBench( corpus.size() * sizeof(char16_t), [&](){
+					jsonSize = 0;
+					doc.TranscodeJSON( corpus.data(), corpus.size(), sink );
+					g_sink = jsonSize;
+				});
+				out.add( "transcode_json", shape, false, corpus.size() * sizeof(char16_t), r );
+			}
+
+			for( unsigned int e = 0; e < 2; ++e ){
+				bool utf8 = e == 0;
+				kkXMLString fileName = dir;
+				fileName += u"/xml_bench_";
+				fileName += toXMLString( corpusShapeName( shape ) );
+				fileName += utf8 ? u"_utf8.xml" : u"_utf16.xml";
+				if( !saveCorpus( fileName, corpus, utf8 ) ){
+					fprintf( stderr, "Can not write corpus file\n" );
+					return 1;
+				}
+				size_t fileSize = 0;
+				{
+					kkPtr<kkFile> f = xmlutil::openFileForReadBin( fileName );
+					fileSize = (size_t)f->size();
+				}
+
+				BenchResult r = runBench( fileSize, [&](){
+					kkXMLDocument doc;
+					doc.ReadFile( fileName );
+				});
+				out.add( "read", shape, utf8, fileSize, r );
+
+				kkXMLDocument doc;
+				if( !doc.ReadFile( fileName ) ){
+					fprintf( stderr, "Can not read corpus file\n" );
+					return 1;
+				}
+				kkXMLString xpath( corpusShapeXPath( shape ) );
+				kkArray<kkXMLNode*> nodes;
+				r = runBench( fileSize, [&](){
+					doc.SelectNodes( xpath, nodes );
+				});
+				out.add( "select_nodes", shape, utf8, fileSize, r );
+
+				// `//Name` of last step, from name index
+				kkXMLString descendants( u"/" );
+				descendants += xpath.substr( xpath.rfind( u'/' ) );
+				r = runBench( fileSize, [&](){
+					doc.SelectNodes( descendants, nodes );
+				});
+				out.add( "select_descendants", shape, utf8, fileSize, r );
+
+				// same nodes, counted without node array
+				kkXMLString countXPath( u"count(" );
+				countXPath += descendants;
+				countXPath += u")";
+				kkXPathValue value;
+				r = runBench( fileSize, [&](){
+					doc.Evaluate( countXPath, value );
+					g_sink = (size_t)value.number;
+				});
+				out.add( "evaluate_count", shape, utf8, fileSize, r );
+
+				kkXMLString id( u"id" );
+				size_t found = 0;
+				r = runBench( fileSize, [&](){
+					found = 0;
+					for( auto n : nodes ){
+						if( n->getAttribute( id ) ) ++found;
+					}
+					g_sink = found;
+				});
+				out.add( "get_attribute", shape, utf8, fileSize, r );
+
+				// `//Name[@id='...']`, from attribute index
+				kkXMLString byId( descendants );
+				byId += u"[@id='";
+				if( nodes.size() ){
+					kkXMLAttribute* a = nodes[ nodes.size() / 2 ]->getAttribute( id );
+					if( a ) byId += a->value;
+				}
+				byId += u"']";
+				doc.AddAttributeIndex( id );
+				kkArray<kkXMLNode*> byIdNodes;
+				r = runBench( fileSize, [&](){
+					doc.SelectNodes( byId, byIdNodes );
+				});
+				out.add( "select_by_id", shape, utf8, fileSize, r );
+
+				kkXMLString outName = fileName;
+				outName += u".out";
+				r = runBench( fileSize, [&](){
+					doc.Write( outName, utf8 );
+				});
+				out.add( "write", shape, utf8, fileSize, r );
+
+				// changed root of parsed document, children go to threads
+				doc.GetRootNode()->setAttribute( u"bench", u"1" );
+				r = runBench( fileSize, [&](){
+					doc.Write( outName, utf8 );
+				});
+				out.add( "write_dirty_root", shape, utf8, fileSize, r );
+
+				// forget source ranges, so every node is serialized
+				doc.GetRootNode()->resetSource();
+				r = runBench( fileSize, [&](){
+					doc.Write( outName, utf8 );
+				});
+				out.add( "write_full", shape, utf8, fileSize, r );
+
+				// same on one thread, write_full uses one per core
+				doc.SetWriteThreads( 1 );
+				r = runBench( fileSize, [&](){
+					doc.Write( outName, utf8 );
+				});
+				doc.SetWriteThreads( 0 );
+				out.add( "write_serial", shape, utf8, fileSize, r );
+			}
+		}
+	}
+
+	kkXMLStringA json( "{\n  \"results\": [" );
+	json += out.m_json;
+	json += "\n  ]\n}\n";
+	if( outFile ){
+		FILE* f = fopen( outFile, "wb" );
+		if( !f ){
+			fprintf( stderr, "Can not create %s\n", outFile );
+			return 1;
+		}
+		fwrite( json.data(), 1, json.size(), f );
+		fclose( f );
+	}else
+		fwrite( json.data(), 1, json.size(), stdout );
+	return 0;
+}
@@ -11,6 +11,11 @@
 #define kkFileExist(x) std::filesystem::exists(x)
 #else
 #include <filesystem>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cassert>
+typedef unsigned int u32;
 #define kkDestroy(x) delete x
 #define kkXMLString std::u16string
 #define kkXMLStringA std::string
@@ -18,6 +23,25 @@
 #define kkFileExist(x) std::filesystem::exists(x)
 #define kkCreate(type) new type
 #endif
+#include <string_view>
+#include <type_traits>
+#include <limits>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <tuple>
+#include <charconv>
+#include <algorithm>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KK_XML_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
 
 
 template<typename _type>
@@ -136,7 +160,8 @@ struct kkFile{
 		DWORD CreationDisposition = 0;
 		switch( action ){
 		case kkFileAction::Open:
-			CreationDisposition = OPEN_ALWAYS;
+			// do not create missing file when only reading it
+			CreationDisposition = access == kkFileAccessMode::Read ? OPEN_EXISTING : OPEN_ALWAYS;
 			break;
 		case kkFileAction::Open_new:
 			CreationDisposition = CREATE_ALWAYS;
@@ -155,6 +180,8 @@ struct kkFile{
 		}
 		m_handle = CreateFileW( (wchar_t*)fileName.data(), m_desiredAccess, ShareMode, NULL,
 			CreationDisposition, FlagsAndAttributes, NULL );
+		if( m_handle == INVALID_HANDLE_VALUE )
+			m_handle = nullptr;
 	//	if( !m_handle )
 			//printWarning( u"Can not create file [%s], error code[%u]",fileName.data(), GetLastError() );
 	}
@@ -166,30 +193,38 @@ struct kkFile{
 	}
 	kkTextFileInfo&	getTextFileInfo(){return m_textInfo;}
 	void			setTextFileInfo( const kkTextFileInfo& info ){m_textInfo = info;}
-	unsigned int	write( unsigned char * data, unsigned int size ){
+	// ReadFile and WriteFile take DWORD sizes, bigger buffers go in parts
+	static constexpr unsigned long long ioChunkSize = 1ull << 30;
+	unsigned long long	writeBytes( const void * data, unsigned long long size ){
+		const unsigned char * ptr = (const unsigned char *)data;
+		unsigned long long written = 0;
+		while( written < size ){
+			unsigned long long left = size - written;
+			DWORD bytesWritten = 0;
+			if( WriteFile( m_handle, ptr + written, (DWORD)(left < ioChunkSize ? left : ioChunkSize), &bytesWritten, NULL ) == FALSE ){
+				fprintf( stderr, "Can not write text to file. Error code [%u]\n", GetLastError() );
+				break;
+			}
+			if( !bytesWritten ) break;
+			written += bytesWritten;
+		}
+		m_pointerPosition += written;
+		return written;
+	}
+	unsigned long long	write( unsigned char * data, unsigned long long size ){
 		assert(m_desiredAccess & GENERIC_WRITE);
 		if( !m_handle ){
 			//printWarning( u"Can not write text to file. m_handle == nullptr" );
 			return 0;
 		}
-		DWORD bytesWritten = 0;
-		if( WriteFile( m_handle, data, size, &bytesWritten, NULL ) == FALSE )
-		{
-			//printWarning( u"Can not write text to file. Error code [%u]", GetLastError() );
-		}else
-			m_pointerPosition += size;
-		return bytesWritten;
+		return writeBytes( data, size );
 	}
 	void	write( const kkXMLString& string ){
 		if( !m_handle ){
 			fprintf( stderr, "Can not write text to file. m_handle == nullptr\n" );
 			return;
 		}
-		DWORD bytesWritten;
-		if( WriteFile( m_handle, string.c_str(), (DWORD)string.size() * sizeof(char16_t), &bytesWritten, NULL ) == FALSE )
-			fprintf( stderr, "Can not write text to file. Error code [%u]\n", GetLastError() );
-		else
-			m_pointerPosition += string.size() * sizeof(char16_t);
+		writeBytes( string.c_str(), string.size() * sizeof(char16_t) );
 	}
 	void	write( const kkXMLStringA& string ){
 		assert( m_isTextFile );
@@ -197,11 +232,7 @@ struct kkFile{
 			fprintf( stderr, "Can not write text to file. m_handle == nullptr\n" );
 			return;
 		}
-		DWORD bytesWritten;
-		if( WriteFile( m_handle, string.c_str(), (DWORD)string.size(), &bytesWritten, NULL ) == FALSE ){
-			fprintf( stderr, "Can not write text to file. Error code [%u]\n", GetLastError() );
-		}else
-			m_pointerPosition += string.size();
+		writeBytes( string.c_str(), string.size() );
 	}
 	void	flush(){
 		if( m_handle )
@@ -210,15 +241,23 @@ struct kkFile{
 	unsigned long long	read( unsigned char * data, unsigned long long size ){
 		assert( m_desiredAccess & GENERIC_READ );
 		if( m_handle ){
-			DWORD readBytesNum = 0;
-			if( ReadFile(	m_handle,
-							data, (DWORD)size,
-							&readBytesNum,
-							NULL
-				) == FALSE ){
-				//printWarning( u"Can not read file. Error code [%u]", GetLastError() );
+			unsigned long long readBytes = 0;
+			while( readBytes < size ){
+				unsigned long long left = size - readBytes;
+				DWORD readBytesNum = 0;
+				if( ReadFile(	m_handle,
+								data + readBytes, (DWORD)(left < ioChunkSize ? left : ioChunkSize),
+								&readBytesNum,
+								NULL
+					) == FALSE ){
+					//printWarning( u"Can not read file. Error code [%u]", GetLastError() );
+					break;
+				}
+				if( !readBytesNum ) break; // end of file
+				readBytes += readBytesNum;
 			}
-			return readBytesNum;
+			m_pointerPosition += readBytes;
+			return readBytes;
 		}
 		return 0;
 	}
@@ -227,7 +266,9 @@ struct kkFile{
 			//printWarning( u"Can not get file size. m_handle == nullptr" );
 			return 0;
 		}
-		return static_cast<unsigned long long>( GetFileSize( m_handle, NULL ) );
+		LARGE_INTEGER li;
+		if( GetFileSizeEx( m_handle, &li ) == FALSE ) return 0;
+		return static_cast<unsigned long long>( li.QuadPart );
 	}
 	unsigned long long		tell(){return m_pointerPosition;}
 	void		seek( unsigned long long distance, kkFileSeekPos pos ){
@@ -246,6 +287,105 @@ struct kkFile{
 #erro Only for windows
 #endif
 
+// Why Read, ParseBuffer, WriteJSON or a query failed, see kkXMLError.
+enum class kkXMLErrorCode : unsigned int{
+	None,
+	FileRead,			// can not open or read file
+	Empty,				// no tokens
+	UnexpectedEnd,		// text ended inside element
+	UnexpectedToken,
+	BadCompressedData,	// gzip data is damaged or cut short
+	UnsupportedCompression, // zstd
+	BadXPath,			// `found` is the expression, `offset` is position in it
+	FileWrite,			// can not create or write output file
+};
+// Parse error. `offset` is position in kkXMLDocument::GetText() (UTF-16 code units),
+// line and column are computed only when asked, see kkXMLDocument::GetErrorPosition.
+struct kkXMLError{
+	kkXMLErrorCode code = kkXMLErrorCode::None;
+	size_t offset = 0;
+	kkXMLString expected;
+	kkXMLString found;
+	void clear(){
+		code = kkXMLErrorCode::None;
+		offset = 0;
+		expected.clear();
+		found.clear();
+	}
+};
+
+// Statistics for Read, Write and SelectNodes.
+// Define KK_XML_STATS before including this file to collect them,
+// otherwise all measuring code is compiled out and kkXMLParseStats stays empty.
+// Phases can be nested: DecodeEntities time is included in Tokenize.
+enum class kkXMLParsePhase : unsigned int{
+	FileIO,			// open and read file / write file
+	Transcode,		// BOM detection, UTF-8 <-> UTF-16
+	Tokenize,		// getTokens
+	DecodeEntities,	// decodeEnts
+	BuildTree,		// analyzeTokens, getSubNode
+	Select,			// SelectNodes
+	Serialize,		// writeNodes
+	NONE
+};
+typedef void(*kkXMLStatsCallback)( kkXMLParsePhase phase, unsigned long long ns, void* userData );
+struct kkXMLParseStats{
+	unsigned long long m_time[ (unsigned int)kkXMLParsePhase::NONE ] = {}; // nanoseconds
+	unsigned long long m_bytesRead = 0;
+	unsigned long long m_bytesWritten = 0;
+	unsigned long long m_tokens = 0;
+	unsigned long long m_nodes = 0;
+	unsigned long long m_attributes = 0;
+	unsigned long long m_entities = 0;		// expanded entity references
+	unsigned long long m_allocations = 0;	// nodes, attributes and tokens created by parser
+	unsigned long long m_selected = 0;		// nodes returned by SelectNodes
+	unsigned int m_maxDepth = 0;			// 32-bit, parser recursion ends far below it
+	kkXMLStatsCallback m_onPhaseBegin = nullptr; // ns is 0
+	kkXMLStatsCallback m_onPhaseEnd = nullptr;
+	void* m_userData = nullptr;
+	void clear(){
+		kkXMLStatsCallback b = m_onPhaseBegin;
+		kkXMLStatsCallback e = m_onPhaseEnd;
+		void* u = m_userData;
+		*this = kkXMLParseStats();
+		m_onPhaseBegin = b;
+		m_onPhaseEnd = e;
+		m_userData = u;
+	}
+};
+#ifdef KK_XML_STATS
+#include <chrono>
+class kkXMLStatsTimer{
+	kkXMLParseStats* m_stats;
+	kkXMLParsePhase m_phase;
+	std::chrono::steady_clock::time_point m_begin;
+public:
+	kkXMLStatsTimer( kkXMLParseStats* stats, kkXMLParsePhase phase ):m_stats( stats ), m_phase( phase ){
+		if( m_stats ){
+			if( m_stats->m_onPhaseBegin ) m_stats->m_onPhaseBegin( m_phase, 0, m_stats->m_userData );
+			m_begin = std::chrono::steady_clock::now();
+		}
+	}
+	~kkXMLStatsTimer(){
+		if( m_stats ){
+			unsigned long long ns = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - m_begin ).count();
+			m_stats->m_time[ (unsigned int)m_phase ] += ns;
+			if( m_stats->m_onPhaseEnd ) m_stats->m_onPhaseEnd( m_phase, ns, m_stats->m_userData );
+		}
+	}
+};
+#define kkXMLStatsConcat2(a,b) a##b
+#define kkXMLStatsConcat(a,b) kkXMLStatsConcat2(a,b)
+#define kkXMLStatsTime(stats,phase) kkXMLStatsTimer kkXMLStatsConcat(_kkXMLStatsTimer,__LINE__)( stats, phase )
+#define kkXMLStatsAdd(stats,field,n) do{ if( stats ) (stats)->field += (n); }while(0)
+#define kkXMLStatsMax(stats,field,n) do{ if( (stats) && (stats)->field < (n) ) (stats)->field = (n); }while(0)
+#else
+#define kkXMLStatsTime(stats,phase)
+#define kkXMLStatsAdd(stats,field,n)
+#define kkXMLStatsMax(stats,field,n)
+#endif
+
 namespace xmlutil
 {
 	inline kkFile* openFileForReadText( const kkXMLString& fileName ){
@@ -283,57 +423,171 @@ namespace xmlutil
 	inline kkFile* createFileForWriteBinShared( const kkXMLString& fileName ){
 		return kkCreate(kkFile)( fileName, kkFileMode::Binary, kkFileAccessMode::Write, kkFileAction::Open_new, kkFileShareMode::Read );
 	}
-	template<typename char_type>
-	bool isDigit( char_type c ){
-		if( c < 0x7B ){
-			if( c >= (char_type)'0' && c <= (char_type)'9' )return true;
+	// Character classes. One table for 0..255, range tables above.
+	enum kkXMLCharClass : unsigned char{
+		cc_space		= 0x01,	// ' ' \t \r \n
+		cc_digit		= 0x02,
+		cc_alpha		= 0x04,
+		cc_nameStart	= 0x08,	// XML NameStartChar
+		cc_name			= 0x10,	// XML NameChar
+		cc_symbol		= 0x20,	// separate token for kkXMLDocument tokenizer
+		cc_XPathSymbol	= 0x40,	// not a part of name in XPath expression
+		cc_escape		= 0x80	// replaced by entity when written: < > & ' "
+	};
+	struct kkXMLCharTable{
+		unsigned char m_class[ 256 ];
+		constexpr kkXMLCharTable():m_class(){
+			m_class[ (unsigned char)' ' ] |= cc_space;
+			m_class[ (unsigned char)'\t' ] |= cc_space;
+			m_class[ (unsigned char)'\r' ] |= cc_space;
+			m_class[ (unsigned char)'\n' ] |= cc_space;
+			for( unsigned int c = '0'; c <= '9'; ++c ) m_class[ c ] |= cc_digit | cc_name;
+			for( unsigned int c = 'a'; c <= 'z'; ++c ) m_class[ c ] |= cc_alpha | cc_nameStart | cc_name;
+			for( unsigned int c = 'A'; c <= 'Z'; ++c ) m_class[ c ] |= cc_alpha | cc_nameStart | cc_name;
+			for( unsigned int c = 0xC0; c <= 0xFF; ++c ){
+				m_class[ c ] |= cc_alpha;
+				if( c != 0xD7 && c != 0xF7 ) m_class[ c ] |= cc_nameStart | cc_name;
+			}
+			m_class[ (unsigned char)'_' ] |= cc_nameStart | cc_name;
+			m_class[ (unsigned char)':' ] |= cc_nameStart | cc_name;
+			m_class[ (unsigned char)'-' ] |= cc_name;
+			m_class[ (unsigned char)'.' ] |= cc_name;
+			m_class[ 0xB7 ] |= cc_name;
+			const char* symbols = "<>/\'\"=?!-";
+			for( unsigned int i = 0; symbols[ i ]; ++i ) m_class[ (unsigned char)symbols[ i ] ] |= cc_symbol;
+			const char* XPathSymbols = "/*'\",=+-@[]()|!";
+			for( unsigned int i = 0; XPathSymbols[ i ]; ++i ) m_class[ (unsigned char)XPathSymbols[ i ] ] |= cc_XPathSymbol;
+			const char* escape = "<>&'\"";
+			for( unsigned int i = 0; escape[ i ]; ++i ) m_class[ (unsigned char)escape[ i ] ] |= cc_escape;
+		}
+	};
+	inline constexpr kkXMLCharTable g_charTable;
+
+	struct kkXMLCharRange{
+		char16_t first;
+		char16_t last;
+	};
+	// Above 0xFF. Surrogates are accepted, they encode #x10000-#xEFFFF.
+	inline constexpr kkXMLCharRange g_nameStartRanges[] = {
+		{ 0x100, 0x2FF }, { 0x370, 0x37D }, { 0x37F, 0x1FFF }, { 0x200C, 0x200D },
+		{ 0x2070, 0x218F }, { 0x2C00, 0x2FEF }, { 0x3001, 0xDFFF }, { 0xF900, 0xFDCF },
+		{ 0xFDF0, 0xFFFD }
+	};
+	inline constexpr kkXMLCharRange g_nameRanges[] = {
+		{ 0x100, 0x37D }, { 0x37F, 0x1FFF }, { 0x200C, 0x200D }, { 0x203F, 0x2040 },
+		{ 0x2070, 0x218F }, { 0x2C00, 0x2FEF }, { 0x3001, 0xDFFF }, { 0xF900, 0xFDCF },
+		{ 0xFDF0, 0xFFFD }
+	};
+	inline constexpr kkXMLCharRange g_alphaRanges[] = {
+		{ 0x100, 0x2AF }, { 0x370, 0x373 }, { 0x376, 0x377 }, { 0x37F, 0x37F },
+		{ 0x386, 0x386 }, { 0x388, 0x38A }, { 0x38C, 0x38C }, { 0x38E, 0x3A1 },
+		{ 0x3A3, 0x481 }, { 0x48A, 0x52F }, { 0x531, 0x556 }, { 0x561, 0x587 },
+		{ 0x5D0, 0x5EA }
+	};
+	template<size_t N>
+	inline bool inRanges( const kkXMLCharRange (&ranges)[ N ], unsigned int c ){
+		size_t lo = 0, hi = N;
+		while( lo < hi ){
+			size_t mid = (lo + hi) / 2;
+			if( c < ranges[ mid ].first ) hi = mid;
+			else if( c > ranges[ mid ].last ) lo = mid + 1;
+			else return true;
 		}
 		return false;
 	}
 	template<typename char_type>
+	inline unsigned int charCode( char_type c ){
+		return (unsigned int)(typename std::make_unsigned<char_type>::type)c;
+	}
+	template<typename char_type>
+	inline bool charIs( char_type c, unsigned char cls ){
+		unsigned int u = charCode( c );
+		return u < 256 && (g_charTable.m_class[ u ] & cls);
+	}
+	// Escaping rules of writeText: text escapes `<`, `>` and `&`, attribute
+	// value also quotes.
+	template<bool attribute>
+	inline bool needsEscape( char16_t c ){
+		if( !charIs( c, cc_escape ) ) return false;
+		return attribute || (c != u'\'' && c != u'\"');
+	}
+	inline const char16_t* escapeEntity( char16_t c ){
+		switch( c ){
+			case u'<': return u"&lt;";
+			case u'>': return u"&gt;";
+			case u'&': return u"&amp;";
+			case u'\'': return u"&apos;";
+			default: return u"&quot;";
+		}
+	}
+#ifdef KK_XML_SSE2
+	inline unsigned int lowestBit( unsigned int mask ){
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward( &index, mask );
+		return (unsigned int)index;
+#else
+		return (unsigned int)__builtin_ctz( mask );
+#endif
+	}
+#endif
+	// Length of run at `str` that is copied as is. With SSE2 16 units are
+	// tested at once, rest one by one.
+	template<bool attribute>
+	inline size_t escapeRun( const char16_t* str, size_t size ){
+		size_t i = 0;
+#ifdef KK_XML_SSE2
+		const __m128i lt = _mm_set1_epi16( (short)u'<' );
+		const __m128i gt = _mm_set1_epi16( (short)u'>' );
+		const __m128i amp = _mm_set1_epi16( (short)u'&' );
+		const __m128i apos = _mm_set1_epi16( (short)u'\'' );
+		const __m128i quot = _mm_set1_epi16( (short)u'\"' );
+		for( ; i + 16 <= size; i += 16 ){
+			__m128i a = _mm_loadu_si128( (const __m128i*)(str + i) );
+			__m128i b = _mm_loadu_si128( (const __m128i*)(str + i + 8) );
+			__m128i ma = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi16( a, lt ), _mm_cmpeq_epi16( a, gt ) ), _mm_cmpeq_epi16( a, amp ) );
+			__m128i mb = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi16( b, lt ), _mm_cmpeq_epi16( b, gt ) ), _mm_cmpeq_epi16( b, amp ) );
+			if( attribute ){
+				ma = _mm_or_si128( ma, _mm_or_si128( _mm_cmpeq_epi16( a, apos ), _mm_cmpeq_epi16( a, quot ) ) );
+				mb = _mm_or_si128( mb, _mm_or_si128( _mm_cmpeq_epi16( b, apos ), _mm_cmpeq_epi16( b, quot ) ) );
+			}
+			// one bit per unit, in order
+			unsigned int mask = (unsigned int)_mm_movemask_epi8( _mm_packs_epi16( ma, mb ) );
+			if( mask ) return i + lowestBit( mask );
+		}
+#endif
+		for( ; i < size; ++i ){
+			if( needsEscape<attribute>( str[ i ] ) ) return i;
+		}
+		return size;
+	}
+	template<typename char_type>
+	bool isDigit( char_type c ){
+		return charIs( c, cc_digit );
+	}
+	template<typename char_type>
 	bool isSpace( char_type c ){
-		if( c == (char_type)' ' ) return true;
-		if( c == (char_type)'\r' ) return true;
-		if( c == (char_type)'\n' ) return true;
-		if( c == (char_type)'\t' ) return true;
-		return false;
+		return charIs( c, cc_space );
 	}
 	template<typename char_type>
 	bool isAlpha( char_type c ){
-		if( c < 0x7B ){
-			if( (c >= (char_type)'a' && c <= (char_type)'z')
-				|| (c >= (char_type)'A' && c <= (char_type)'Z') )
-				return true;
-		}else if( c >= 0xC0 && c <= 0x2AF ){
-			return true;
-		}else if( c >= 0x370 && c < 0x374 ){
-			return true;
-		}else if( c >= 0x376 && c < 0x378 ){
-			return true;
-		}else if( c >= 0x376 && c < 0x378 ){
-			return true;
-		}else if( c == 0x37F || c == 0x386 ){
-			return true;
-		}else if( c > 0x387 && c < 0x38B ){
-			return true;
-		}else if( c == 0x38C ){
-			return true;
-		}else if( c > 0x38D && c < 0x3A2 ){
-			return true;
-		}else if( c > 0x3A2 && c < 0x482 ){
-			return true;
-		}else if( c > 0x489 && c < 0x530 ){
-			return true;
-		}else if( c > 0x530 && c < 0x557 ){
-			return true;
-		}else if( c > 0x560 && c < 0x588 ){
-			return true;
-		}else if( c >= 0x5D0 && c < 0x5EB ){
-			return true;
-		}
-		return false;
+		unsigned int u = charCode( c );
+		if( u < 256 ) return g_charTable.m_class[ u ] & cc_alpha;
+		return inRanges( g_alphaRanges, u );
+	}
+	template<typename char_type>
+	bool isNameStartChar( char_type c ){
+		unsigned int u = charCode( c );
+		if( u < 256 ) return g_charTable.m_class[ u ] & cc_nameStart;
+		return inRanges( g_nameStartRanges, u );
+	}
+	template<typename char_type>
+	bool isNameChar( char_type c ){
+		unsigned int u = charCode( c );
+		if( u < 256 ) return g_charTable.m_class[ u ] & cc_name;
+		return inRanges( g_nameRanges, u );
 	}
-	inline void string_UTF16_to_UTF8(kkXMLString& utf16, kkXMLStringA& utf8 ){
+	inline void string_UTF16_to_UTF8(const kkXMLString& utf16, kkXMLStringA& utf8 ){
 		size_t sz = utf16.size();
 		for( size_t i = 0u; i < sz; ++i ){
 			char16_t ch16 = utf16[ i ];
@@ -342,23 +596,32 @@ namespace xmlutil
 			}else if( ch16 < 0x800 ){
 				utf8 += (char)((ch16>>6)|0xc0);
 				utf8 += (char)((ch16&0x3f)|0x80);
+			}else if( ch16 >= 0xD800 && ch16 < 0xDC00 && i + 1u < sz
+				&& utf16[ i + 1u ] >= 0xDC00 && utf16[ i + 1u ] < 0xE000 ){
+				unsigned int uni = 0x10000 + (((unsigned int)ch16 - 0xD800) << 10) + (utf16[ ++i ] - 0xDC00);
+				utf8 += (char)((uni>>18)|0xf0);
+				utf8 += (char)(((uni>>12)&0x3f)|0x80);
+				utf8 += (char)(((uni>>6)&0x3f)|0x80);
+				utf8 += (char)((uni&0x3f)|0x80);
+			}else{
+				utf8 += (char)((ch16>>12)|0xe0);
+				utf8 += (char)(((ch16>>6)&0x3f)|0x80);
+				utf8 += (char)((ch16&0x3f)|0x80);
 			}
 		}
 	}
-	inline void string_UTF8_to_UTF16( kkXMLString& utf16, kkXMLStringA& utf8 ){
-		std::vector<unsigned int> unicode;
-		unsigned int i = 0u;
-		auto sz = utf8.size();
+	inline void string_UTF8_to_UTF16( kkXMLString& utf16, const char* utf8, size_t sz ){
+		utf16.reserve( utf16.size() + sz );
+		size_t i = 0u;
 		while( i < sz ){
 			unsigned int uni = 0u;
 			unsigned int todo = 0u;
-//				bool error = false;
-			unsigned char ch = utf8[i++];
+			unsigned char ch = (unsigned char)utf8[i++];
 			if( ch <= 0x7F ){
 				uni = ch;
 				todo = 0;
 			}else if( ch <= 0xBF ){
-				//throw std::logic_error("not a UTF-8 string");
+				//not a UTF-8 string
 			}else if ( ch <= 0xDF ){
 				uni = ch&0x1F;
 				todo = 1;
@@ -369,141 +632,658 @@ namespace xmlutil
 				uni = ch&0x07;
 				todo = 3;
 			}else{
-				//throw std::logic_error("not a UTF-8 string");
-			}
-			for( unsigned int j = 0; j < todo; ++j ){
-				//if( i == utf8.size() )
-					//throw std::logic_error("not a UTF-8 string");
-				unsigned char ch2 = utf8[i++];
-				//if( ch < 0x80 || ch > 0xBF )
-					//throw std::logic_error("not a UTF-8 string");
+				//not a UTF-8 string
+			}
+			for( unsigned int j = 0; j < todo && i < sz; ++j ){
+				unsigned char ch2 = (unsigned char)utf8[i++];
 				uni <<= 6;
 				uni += ch2 & 0x3F;
 			}
-			//if( uni >= 0xD800 && uni <= 0xDFFF )
-				//throw std::logic_error("not a UTF-8 string");
-			//if( uni > 0x10FFFF )
-				//throw std::logic_error("not a UTF-8 string");
-			unicode.push_back(uni);
-		}
-		auto sz2 = unicode.size();
-		for( unsigned int o = 0u; o < sz2; ++o ){
-			unsigned int uni = unicode[o];
 			if( uni <= 0xFFFF ){
 				utf16 += (char16_t)uni;
 			}else{
 				uni -= 0x10000;
-				utf16 += (wchar_t)((uni >> 10) + 0xD800);
-				utf16 += (wchar_t)((uni & 0x3FF) + 0xDC00);
+				utf16 += (char16_t)((uni >> 10) + 0xD800);
+				utf16 += (char16_t)((uni & 0x3FF) + 0xDC00);
+			}
+		}
+	}
+	inline void string_UTF8_to_UTF16( kkXMLString& utf16, const kkXMLStringA& utf8 ){
+		string_UTF8_to_UTF16( utf16, utf8.data(), utf8.size() );
+	}
+	// Raw UTF-16 bytes without BOM. Returns number of bytes used, a last odd
+	// byte is left.
+	inline size_t string_UTF16Bytes_to_UTF16( kkXMLString& utf16, const char* bytes, size_t sz, bool isBE ){
+		sz &= ~(size_t)1u;
+		utf16.reserve( utf16.size() + sz / 2u );
+		union{
+			char16_t unicode;
+			char b[ 2u ];
+		}un;
+		for( size_t i = 0u; i < sz; i += 2u ){
+			if( isBE ){
+				un.b[ 0u ] = bytes[ i + 1u ];
+				un.b[ 1u ] = bytes[ i ];
+			}else{
+				un.b[ 0u ] = bytes[ i ];
+				un.b[ 1u ] = bytes[ i + 1u ];
+			}
+			utf16 += un.unicode;
+		}
+		return sz;
+	}
+	// UTF-8 that comes in pieces, a sequence can be split between them.
+	struct UTF8ChunkDecoder{
+		char m_tail[ 4u ];
+		unsigned int m_tailSize = 0u;
+		static unsigned int sequenceSize( unsigned char ch ){
+			if( ch >= 0xC0 && ch <= 0xDF ) return 2u;
+			if( ch >= 0xE0 && ch <= 0xEF ) return 3u;
+			if( ch >= 0xF0 && ch <= 0xF7 ) return 4u;
+			return 1u;
+		}
+		void decode( kkXMLString& utf16, const char* data, size_t sz ){
+			if( m_tailSize ){
+				unsigned int need = sequenceSize( (unsigned char)m_tail[ 0u ] );
+				while( m_tailSize < need && sz ){
+					m_tail[ m_tailSize++ ] = *data++;
+					--sz;
+				}
+				if( m_tailSize < need ) return;
+				string_UTF8_to_UTF16( utf16, m_tail, m_tailSize );
+				m_tailSize = 0u;
+			}
+			// find start of last sequence, keep it if it is not complete
+			size_t lead = sz;
+			for( unsigned int i = 0u; i < 4u && lead; ++i ){
+				--lead;
+				if( ((unsigned char)data[ lead ] & 0xC0) != 0x80 ) break;
+			}
+			size_t complete = sz;
+			if( lead < sz && lead + sequenceSize( (unsigned char)data[ lead ] ) > sz )
+				complete = lead;
+			string_UTF8_to_UTF16( utf16, data, complete );
+			for( size_t i = complete; i < sz; ++i )
+				m_tail[ m_tailSize++ ] = data[ i ];
+		}
+		// Input ended, decode what is left as is.
+		void finish( kkXMLString& utf16 ){
+			string_UTF8_to_UTF16( utf16, m_tail, m_tailSize );
+			m_tailSize = 0u;
+		}
+	};
+	// Files at least this big are read by readAhead
+	constexpr size_t readAheadChunkSize = 1u << 20;
+	constexpr size_t readAheadMinSize = readAheadChunkSize * 4u;
+	// Trees with at least this many nodes are written by several threads
+	constexpr size_t parallelWriteMinNodes = 1u << 16;
+	// Double buffered reading of `size` bytes. While `consume( const char* data, size_t size )`
+	// works on one chunk, next one is read on a separate thread, so load time
+	// is close to max( I/O, consume ) instead of their sum. `buffer` is scratch
+	// memory for two chunks. Returns false if file ended early. If `consume`
+	// throws, the reading thread is stopped and joined before it goes on.
+	template<typename F>
+	inline bool readAhead( kkFile* file, size_t size, size_t chunkSize, kkXMLStringA& buffer, F consume ){
+		buffer.resize( chunkSize * 2u );
+		char* chunk[ 2u ] = { &buffer[ 0u ], &buffer[ chunkSize ] };
+		size_t filled[ 2u ] = { 0u, 0u };
+		bool ready[ 2u ] = { false, false };
+		bool stop = false;
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::thread io( [&](){
+			size_t left = size;
+			for( unsigned int i = 0u; left; i ^= 1u ){
+				{
+					std::unique_lock<std::mutex> lock( mutex );
+					cv.wait( lock, [&]{ return !ready[ i ] || stop; } );
+					if( stop ) return;
+				}
+				size_t n = (size_t)file->read( (unsigned char*)chunk[ i ], left < chunkSize ? left : chunkSize );
+				{
+					std::lock_guard<std::mutex> lock( mutex );
+					filled[ i ] = n;
+					ready[ i ] = true;
+				}
+				cv.notify_all();
+				if( !n ) return;
+				left -= n;
+			}
+		});
+		// joins on every way out, also when `consume` throws
+		struct _join{
+			std::thread& io;
+			bool& stop;
+			std::mutex& mutex;
+			std::condition_variable& cv;
+			~_join(){
+				{
+					std::lock_guard<std::mutex> lock( mutex );
+					stop = true;
+				}
+				cv.notify_all();
+				io.join();
+			}
+		} join{ io, stop, mutex, cv };
+		size_t left = size;
+		for( unsigned int i = 0u; left; i ^= 1u ){
+			{
+				std::unique_lock<std::mutex> lock( mutex );
+				cv.wait( lock, [&]{ return ready[ i ]; } );
+			}
+			if( !filled[ i ] ) break;
+			consume( (const char*)chunk[ i ], filled[ i ] );
+			left -= filled[ i ];
+			{
+				std::lock_guard<std::mutex> lock( mutex );
+				ready[ i ] = false;
+			}
+			cv.notify_all();
+		}
+		return !left;
+	}
+	// BOM detection and UTF-8 or UTF-16 decoding of text that comes in chunks.
+	struct TextChunkDecoder{
+		kkXMLString* m_utf16;
+		UTF8ChunkDecoder m_utf8;
+		char m_head[ 3u ];
+		unsigned int m_headSize = 0u;
+		bool m_started = false;
+		bool m_isUTF8 = true;
+		bool m_isBE = false;
+		char m_odd = 0;
+		bool m_hasOdd = false;
+		TextChunkDecoder( kkXMLString& utf16 ): m_utf16( &utf16 ){}
+		void decode( const char* data, size_t size ){
+			while( !m_started && size ){
+				m_head[ m_headSize++ ] = *data++;
+				--size;
+				if( m_headSize == 3u ) start();
+			}
+			if( size ) body( data, size );
+		}
+		void finish(){
+			if( !m_started ) start();
+			if( m_isUTF8 ) m_utf8.finish( *m_utf16 );
+		}
+	private:
+		void start(){
+			m_started = true;
+			unsigned int skip = 0u;
+			unsigned char b = m_headSize ? (unsigned char)m_head[ 0u ] : 0u;
+			if( b == 0xEF ){
+				skip = 3u;
+			}else if( b == 0xFE ){ // utf16 BE
+				m_isUTF8 = false;
+				m_isBE = true;
+				skip = 2u;
+			}else if( b == 0xFF ){
+				m_isUTF8 = false;
+				skip = 2u;
+			}
+			if( skip > m_headSize ) skip = m_headSize;
+			body( m_head + skip, m_headSize - skip );
+		}
+		void body( const char* data, size_t size ){
+			if( m_isUTF8 ){
+				m_utf8.decode( *m_utf16, data, size );
+				return;
+			}
+			if( m_hasOdd && size ){
+				char pair[ 2u ] = { m_odd, *data };
+				string_UTF16Bytes_to_UTF16( *m_utf16, pair, 2u, m_isBE );
+				++data;
+				--size;
+				m_hasOdd = false;
+			}
+			size_t done = string_UTF16Bytes_to_UTF16( *m_utf16, data, size, m_isBE );
+			if( done < size ){
+				m_odd = data[ done ];
+				m_hasOdd = true;
+			}
+		}
+	};
+
+	struct kkXMLCRC32Table{
+		u32 m_crc[ 256 ];
+		constexpr kkXMLCRC32Table():m_crc(){
+			for( u32 i = 0; i < 256; ++i ){
+				u32 c = i;
+				for( unsigned int k = 0; k < 8; ++k ) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				m_crc[ i ] = c;
+			}
+		}
+	};
+	inline constexpr kkXMLCRC32Table g_crc32Table;
+	inline u32 crc32( u32 crc, const char* data, size_t size ){
+		crc = ~crc;
+		for( size_t i = 0; i < size; ++i )
+			crc = g_crc32Table.m_crc[ (crc ^ (unsigned char)data[ i ]) & 0xFF ] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	// gzip (RFC 1951, 1952) decompression. Compressed data is read from file
+	// in chunks, decompressed data is given to `consume( const char* data, size_t size )`
+	// in chunks, so none of them is held in memory whole. Concatenated gzip
+	// members are decompressed one after another.
+	template<typename F>
+	class GzipReader{
+		kkFile* m_file;
+		F& m_consume;
+		kkXMLStringA& m_in;
+		size_t m_inPos = 0;
+		size_t m_inSize = 0;
+		unsigned long long m_inTotal = 0;
+		bool m_error = false;
+		u32 m_bitBuf = 0;
+		unsigned int m_bitCount = 0;
+
+		static constexpr u32 windowSize = 1u << 15;
+		static constexpr u32 outChunkSize = 1u << 16;
+		kkXMLStringA m_window;
+		u32 m_windowPos = 0;
+		unsigned long long m_memberSize = 0; // output of current member
+		kkXMLStringA m_out;
+		u32 m_outSize = 0;
+		u32 m_crc = 0;
+
+		struct _huffman{
+			short count[ 16 ];	// number of codes of each length
+			short symbol[ 288 ];	// symbols ordered by code
+		};
+		_huffman m_lengthCodes;
+		_huffman m_distanceCodes;
+
+		bool refill(){
+			m_inSize = (size_t)m_file->read( (unsigned char*)&m_in[ 0 ], m_in.size() );
+			m_inPos = 0;
+			m_inTotal += m_inSize;
+			return m_inSize != 0;
+		}
+		u32 bits( unsigned int n ){
+			while( m_bitCount < n ){
+				if( m_inPos == m_inSize && !refill() ){
+					m_error = true;
+					return 0;
+				}
+				m_bitBuf |= (u32)(unsigned char)m_in[ m_inPos++ ] << m_bitCount;
+				m_bitCount += 8;
+			}
+			u32 v = m_bitBuf & ((1u << n) - 1u);
+			m_bitBuf >>= n;
+			m_bitCount -= n;
+			return v;
+		}
+		void alignToByte(){
+			m_bitBuf >>= m_bitCount & 7u;
+			m_bitCount -= m_bitCount & 7u;
+		}
+		bool hasMoreInput(){
+			return m_bitCount || m_inPos < m_inSize || refill();
+		}
+		void flush(){
+			m_crc = crc32( m_crc, m_out.data(), m_outSize );
+			m_consume( (const char*)m_out.data(), (size_t)m_outSize );
+			m_outSize = 0;
+		}
+		void put( char c ){
+			m_window[ m_windowPos++ & (windowSize - 1u) ] = c;
+			++m_memberSize;
+			m_out[ m_outSize++ ] = c;
+			if( m_outSize == outChunkSize ) flush();
+		}
+
+		// Canonical Huffman code from code lengths. Incomplete codes are allowed.
+		bool build( _huffman& h, const short* lengths, unsigned int n ){
+			for( unsigned int i = 0; i < 16; ++i ) h.count[ i ] = 0;
+			for( unsigned int i = 0; i < n; ++i ) ++h.count[ lengths[ i ] ];
+			int left = 1;
+			for( unsigned int len = 1; len < 16; ++len ){
+				left <<= 1;
+				left -= h.count[ len ];
+				if( left < 0 ) return false; // over-subscribed
+			}
+			short offsets[ 16 ];
+			offsets[ 1 ] = 0;
+			for( unsigned int len = 1; len < 15; ++len ) offsets[ len + 1 ] = offsets[ len ] + h.count[ len ];
+			for( unsigned int i = 0; i < n; ++i ){
+				if( lengths[ i ] ) h.symbol[ offsets[ lengths[ i ] ]++ ] = (short)i;
+			}
+			return true;
+		}
+		int decode( const _huffman& h ){
+			int code = 0;
+			int first = 0;
+			int index = 0;
+			for( unsigned int len = 1; len < 16; ++len ){
+				code |= (int)bits( 1 );
+				int count = h.count[ len ];
+				if( code - count < first ) return h.symbol[ index + (code - first) ];
+				index += count;
+				first += count;
+				first <<= 1;
+				code <<= 1;
+			}
+			m_error = true;
+			return -1;
+		}
+		bool stored(){
+			alignToByte();
+			u32 len = bits( 16 );
+			u32 nlen = bits( 16 );
+			if( m_error || len != (~nlen & 0xFFFF) ) return false;
+			while( len-- && !m_error ) put( (char)bits( 8 ) );
+			return !m_error;
+		}
+		bool codes(){
+			static const short lengthBase[ 29 ] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+				35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+			static const short lengthExtra[ 29 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+				3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+			static const short distanceBase[ 30 ] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+				257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+			static const short distanceExtra[ 30 ] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+				7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+			for(;;){
+				int symbol = decode( m_lengthCodes );
+				if( m_error ) return false;
+				if( symbol < 256 ){
+					put( (char)symbol );
+				}else if( symbol == 256 ){
+					return true;
+				}else{
+					symbol -= 257;
+					if( symbol >= 29 ) return false;
+					u32 len = lengthBase[ symbol ] + bits( lengthExtra[ symbol ] );
+					symbol = decode( m_distanceCodes );
+					if( m_error || symbol < 0 || symbol >= 30 ) return false;
+					u32 dist = distanceBase[ symbol ] + bits( distanceExtra[ symbol ] );
+					if( m_error || dist > m_memberSize ) return false;
+					while( len-- ) put( m_window[ (m_windowPos - dist) & (windowSize - 1u) ] );
+				}
+			}
+		}
+		bool fixed(){
+			short lengths[ 288 ];
+			unsigned int i = 0;
+			for( ; i < 144; ++i ) lengths[ i ] = 8;
+			for( ; i < 256; ++i ) lengths[ i ] = 9;
+			for( ; i < 280; ++i ) lengths[ i ] = 7;
+			for( ; i < 288; ++i ) lengths[ i ] = 8;
+			build( m_lengthCodes, lengths, 288 );
+			for( i = 0; i < 30; ++i ) lengths[ i ] = 5;
+			build( m_distanceCodes, lengths, 30 );
+			return codes();
+		}
+		bool dynamic(){
+			static const unsigned char order[ 19 ] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+			short lengths[ 288 + 32 ];
+			u32 nlen = bits( 5 ) + 257;
+			u32 ndist = bits( 5 ) + 1;
+			u32 ncode = bits( 4 ) + 4;
+			if( m_error || nlen > 286 || ndist > 30 ) return false;
+			u32 i = 0;
+			for( ; i < ncode; ++i ) lengths[ order[ i ] ] = (short)bits( 3 );
+			for( ; i < 19; ++i ) lengths[ order[ i ] ] = 0;
+			if( !build( m_lengthCodes, lengths, 19 ) ) return false;
+			for( i = 0; i < nlen + ndist; ){
+				int symbol = decode( m_lengthCodes );
+				if( m_error ) return false;
+				if( symbol < 16 ){
+					lengths[ i++ ] = (short)symbol;
+					continue;
+				}
+				short len = 0;
+				u32 repeat = 0;
+				if( symbol == 16 ){
+					if( !i ) return false;
+					len = lengths[ i - 1 ];
+					repeat = 3 + bits( 2 );
+				}else if( symbol == 17 ){
+					repeat = 3 + bits( 3 );
+				}else{
+					repeat = 11 + bits( 7 );
+				}
+				if( i + repeat > nlen + ndist ) return false;
+				while( repeat-- ) lengths[ i++ ] = len;
+			}
+			if( !lengths[ 256 ] ) return false; // no end of block code
+			if( !build( m_lengthCodes, lengths, nlen ) ) return false;
+			if( !build( m_distanceCodes, lengths + nlen, ndist ) ) return false;
+			return codes();
+		}
+		bool header(){
+			if( bits( 8 ) != 0x1F || bits( 8 ) != 0x8B || bits( 8 ) != 8 ) return false;
+			u32 flags = bits( 8 );
+			bits( 16 ); bits( 16 ); // mtime
+			bits( 16 ); // xfl, os
+			if( flags & 4 ){ // extra
+				u32 len = bits( 16 );
+				while( len-- && !m_error ) bits( 8 );
 			}
+			if( flags & 8 ) while( bits( 8 ) && !m_error ); // name
+			if( flags & 16 ) while( bits( 8 ) && !m_error ); // comment
+			if( flags & 2 ) bits( 16 ); // header crc
+			return !m_error;
+		}
+		bool member(){
+			if( !header() ) return false;
+			m_crc = 0;
+			m_memberSize = 0;
+			u32 last = 0;
+			do{
+				last = bits( 1 );
+				u32 type = bits( 2 );
+				bool ok = false;
+				if( type == 0 ) ok = stored();
+				else if( type == 1 ) ok = fixed();
+				else if( type == 2 ) ok = dynamic();
+				if( !ok || m_error ) return false;
+			}while( !last );
+			flush();
+			alignToByte();
+			u32 crc = bits( 16 );
+			crc |= bits( 16 ) << 16;
+			u32 size = bits( 16 );
+			size |= bits( 16 ) << 16;
+			return !m_error && crc == m_crc && size == (u32)m_memberSize;
 		}
+	public:
+		GzipReader( kkFile* file, kkXMLStringA& inBuffer, F& consume )
+		:m_file( file ), m_consume( consume ), m_in( inBuffer ){
+			m_in.resize( outChunkSize );
+			m_window.resize( windowSize );
+			m_out.resize( outChunkSize );
+		}
+		bool read(){
+			do{
+				if( !member() ) return false;
+			}while( hasMoreInput() );
+			return true;
+		}
+		// compressed bytes read from file
+		unsigned long long bytesRead() const { return m_inTotal; }
+	};
+	template<typename F>
+	inline bool readGzip( kkFile* file, kkXMLStringA& inBuffer, F consume, unsigned long long* bytesRead = nullptr ){
+		GzipReader<F> reader( file, inBuffer, consume );
+		bool ok = reader.read();
+		if( bytesRead ) *bytesRead = reader.bytesRead();
+		return ok;
 	}
-	inline bool readTextFromFileForUnicode( const kkXMLString& fileName, kkXMLString& utf16 )
+	// `scratch` receives the raw file bytes; pass the same buffer to avoid
+	// allocating on every read. On failure `error` gets the reason and
+	// `utf16` may hold a part of the text.
+	inline bool readTextFromFileForUnicode( const kkXMLString& fileName, kkXMLString& utf16, kkXMLParseStats* stats = nullptr,
+		kkXMLStringA* scratch = nullptr, kkXMLErrorCode* error = nullptr )
 	{
-		kkFile* file = xmlutil::openFileForReadBin( fileName );
-		if( !file ){
-			kkDestroy(file);
-			return false;
+		(void)stats;
+		kkXMLErrorCode localError;
+		kkXMLErrorCode& code = error ? *error : localError;
+		code = kkXMLErrorCode::FileRead;
+		// on stack, reading a file does not allocate for it
+		kkFile file( fileName, kkFileMode::Binary, kkFileAccessMode::Read, kkFileAction::Open );
+		if( !file.m_handle ) return false;
+		size_t sz = (size_t)file.size();
+		if( sz < 4 ) return false;
+		unsigned char bom[ 4u ];
+		file.read( bom, 4u );
+		file.seek( 0u, kkFileSeekPos::Begin );
+
+		kkXMLStringA localBytes;
+		kkXMLStringA& textBytes = scratch ? *scratch : localBytes;
+		if( bom[ 0u ] == 0x1F && bom[ 1u ] == 0x8B ){
+			// gzip, BOM is inside of compressed data
+			TextChunkDecoder decoder( utf16 );
+			unsigned long long compressed = 0;
+			bool ok = readGzip( &file, textBytes, [&]( const char* data, size_t size ){
+				kkXMLStatsTime( stats, kkXMLParsePhase::Transcode );
+				decoder.decode( data, size );
+			}, &compressed );
+			decoder.finish();
+			kkXMLStatsAdd( stats, m_bytesRead, compressed );
+			if( !ok ){
+				code = kkXMLErrorCode::BadCompressedData;
+				return false;
+			}
+			code = kkXMLErrorCode::None;
+			return true;
 		}
-		size_t sz = (size_t)file->size();
-		if( sz < 4 ){
-			kkDestroy(file);
+		if( bom[ 0u ] == 0x28 && bom[ 1u ] == 0xB5 && bom[ 2u ] == 0x2F && bom[ 3u ] == 0xFD ){
+			code = kkXMLErrorCode::UnsupportedCompression;
 			return false;
 		}
-		unsigned char bom[ 3u ];
-		file->read( bom, 3u );
-		file->seek( 0u, kkFileSeekPos::Begin );
+		if( sz >= readAheadMinSize ){
+			// transcode chunks while next ones are read
+			utf16.reserve( utf16.size() + sz );
+			TextChunkDecoder decoder( utf16 );
+			bool ok = readAhead( &file, sz, readAheadChunkSize, textBytes, [&]( const char* data, size_t size ){
+				kkXMLStatsTime( stats, kkXMLParsePhase::Transcode );
+				decoder.decode( data, size );
+			});
+			decoder.finish();
+			kkXMLStatsAdd( stats, m_bytesRead, sz );
+			if( !ok ) return false;
+			code = kkXMLErrorCode::None;
+			return true;
+		}
+
 		bool isUTF8 = false;
 		bool isBE = false;
 		if( bom[ 0u ] == 0xEF ){
-			file->seek( 3u, kkFileSeekPos::Begin );
+			file.seek( 3u, kkFileSeekPos::Begin );
 			isUTF8 = true;
 			sz -= 3u;
 		}else if( bom[ 0u ] == 0xFE ){ // utf16 BE
-			file->seek( 2u, kkFileSeekPos::Begin );
+			file.seek( 2u, kkFileSeekPos::Begin );
 			isBE = true;
 			sz -= 2u;
 		}else if( bom[ 0u ] == 0xFF ){
-			file->seek( 2u, kkFileSeekPos::Begin );
+			file.seek( 2u, kkFileSeekPos::Begin );
 			sz -= 2u;
 		}else{
 			// else - utf8 w/o bom
 			isUTF8 = true;
 		}
 
-		unsigned char* buf = new unsigned char[sz];
-		file->read( buf, sz );
-
-		kkXMLStringA textBytes;
-		textBytes.reserve( (unsigned int)sz + 2 );
-		
-		for(unsigned long long i = 0; i < sz; ++i)
+		textBytes.resize( sz );
 		{
-			textBytes.push_back( (char)buf[i] );
+		kkXMLStatsTime( stats, kkXMLParsePhase::FileIO );
+		file.read( (unsigned char*)textBytes.data(), sz );
 		}
-		//textBytes.setSize( (unsigned int)sz );
-		//textBytes.data()[textBytes.size()] = 0;
+		kkXMLStatsAdd( stats, m_bytesRead, sz );
+		kkXMLStatsTime( stats, kkXMLParsePhase::Transcode );
 
 		if( !isUTF8 ){
-			union{
-				char16_t unicode;
-				char b[ 2u ];
-			}un;
-			for( unsigned int i = 0u; i < sz; i += 2u ){
-				/*char16_t ch16 = textBytes[ i ];
-				if( isBE ){
-					ch16 <<= kkConst8U;
-					ch16 |= textBytes[ i + 1u ];
-				}else{
-					char16_t ch16_2 = textBytes[ i + 1u ];
-					ch16_2 <<= kkConst8U;
-					ch16 |= ch16_2;
-				}*/
-
-				if( isBE ){
-					un.b[ 0u ] = textBytes[ i + 1u ];
-					un.b[ 1u ] = textBytes[ i ];
-				}else{
-					un.b[ 0u ] = textBytes[ i ];
-					un.b[ 1u ] = textBytes[ i + 1u ];
-				}
-
-				utf16 += un.unicode;
-			}
-
+			xmlutil::string_UTF16Bytes_to_UTF16( utf16, textBytes.data(), sz, isBE );
 		}else
 		{
 			xmlutil::string_UTF8_to_UTF16( utf16, textBytes );
 		}
-		kkDestroy(file);
+		code = kkXMLErrorCode::None;
 		return true;
 	}
-	template<typename Type>
-	inline void stringTrimSpace( Type& str ){
-		while( true ){
-			if( isSpace( str[0] ) ) str.erase(0,1);
-			else  break;
+	// Same as readTextFromFileForUnicode, but text is decoded in chunks into
+	// `window` and `consume( kkXMLString& window, bool last )` is called after
+	// each one. It removes from window the text it used, so the whole text is
+	// never held. `last` is true once, after all text was given.
+	template<typename F>
+	inline bool readTextFromFileInChunks( const kkXMLString& fileName, kkXMLString& window, F consume, kkXMLParseStats* stats = nullptr,
+		kkXMLStringA* scratch = nullptr, kkXMLErrorCode* error = nullptr )
+	{
+		(void)stats;
+		kkXMLErrorCode localError;
+		kkXMLErrorCode& code = error ? *error : localError;
+		code = kkXMLErrorCode::FileRead;
+		kkPtr<kkFile> file;
+		{
+		kkXMLStatsTime( stats, kkXMLParsePhase::FileIO );
+		file = xmlutil::openFileForReadBin( fileName );
 		}
-		while( true ){
-			if( isSpace(str[str.size() - 1u]) )str.pop_back();
-			else break;
+		if( !file.ptr() ) return false;
+		size_t sz = (size_t)file->size();
+		if( sz < 4 ) return false;
+		unsigned char bom[ 4u ];
+		file->read( bom, 4u );
+		file->seek( 0u, kkFileSeekPos::Begin );
+
+		kkXMLStringA localBytes;
+		kkXMLStringA& textBytes = scratch ? *scratch : localBytes;
+		TextChunkDecoder decoder( window );
+		auto chunk = [&]( const char* data, size_t size ){
+			{
+			kkXMLStatsTime( stats, kkXMLParsePhase::Transcode );
+			decoder.decode( data, size );
+			}
+			consume( window, false );
+		};
+		if( bom[ 0u ] == 0x1F && bom[ 1u ] == 0x8B ){
+			unsigned long long compressed = 0;
+			bool ok = readGzip( file.ptr(), textBytes, chunk, &compressed );
+			kkXMLStatsAdd( stats, m_bytesRead, compressed );
+			if( !ok ){
+				code = kkXMLErrorCode::BadCompressedData;
+				return false;
+			}
+		}else if( bom[ 0u ] == 0x28 && bom[ 1u ] == 0xB5 && bom[ 2u ] == 0x2F && bom[ 3u ] == 0xFD ){
+			code = kkXMLErrorCode::UnsupportedCompression;
+			return false;
+		}else{
+			bool ok = readAhead( file.ptr(), sz, readAheadChunkSize, textBytes, chunk );
+			kkXMLStatsAdd( stats, m_bytesRead, sz );
+			if( !ok ) return false;
 		}
+		decoder.finish();
+		consume( window, true );
+		code = kkXMLErrorCode::None;
+		return true;
+	}
+	template<typename Type>
+	inline void stringTrimSpace( Type& str ){
+		size_t sz = str.size();
+		size_t first = 0;
+		while( first < sz && isSpace( str[ first ] ) ) ++first;
+		while( sz > first && isSpace( str[ sz - 1u ] ) ) --sz;
+		if( sz < str.size() ) str.erase( sz );
+		if( first ) str.erase( 0, first );
 	}
-	inline void stringReplaseSubString( kkXMLString& source, const kkXMLString& target, const kkXMLString& text )
+	// Returns number of replaced substrings
+	inline size_t stringReplaseSubString( kkXMLString& source, const kkXMLString& target, const kkXMLString& text )
 	{
+		size_t count = 0;
 		kkXMLString result;
-		u32 source_sz = source.size();
-		u32 target_sz = target.size();
-		u32 text_sz   = text.size();
-		for( u32 i = 0u; i < source_sz; ++i ){
+		size_t source_sz = source.size();
+		size_t target_sz = target.size();
+		size_t text_sz   = text.size();
+		for( size_t i = 0u; i < source_sz; ++i ){
 			if( (source_sz - i) < target_sz ){
-				for( u32 i2 = i; i2 < source_sz; ++i2 ){
+				for( size_t i2 = i; i2 < source_sz; ++i2 ){
 					result += source[ i2 ];
 				}
 				break;
 			}
 			bool comp = false;
-			for( u32 o = 0u; o < target_sz; ++o ){
+			for( size_t o = 0u; o < target_sz; ++o ){
 				if( source[ i + o ] == target[ o ] ){
 					if( !comp ) comp = true;
 				}else{
@@ -512,16 +1292,182 @@ namespace xmlutil
 				}
 			}
 			if( comp ){
-				for( u32 o = 0u; o < text_sz; ++o ){
+				for( size_t o = 0u; o < text_sz; ++o ){
 					result += text[ o ];
 				}
 				i += target_sz - 1u;
+				++count;
 			}else result += source[ i ];
 		}
 		if( result.size() ){
 			source.clear();
 			source.assign( result );
 		}
+		return count;
+	}
+
+	// 64-bit hashes for kkXMLNode::hash. hashString is FNV-1a with length,
+	// hashMix is the splitmix64 finalizer.
+	inline unsigned long long hashMix( unsigned long long h ){
+		h ^= h >> 30;
+		h *= 0xBF58476D1CE4E5B9ull;
+		h ^= h >> 27;
+		h *= 0x94D049BB133111EBull;
+		return h ^ (h >> 31);
+	}
+	inline unsigned long long hashString( unsigned long long h, const kkXMLString& str ){
+		size_t sz = str.size();
+		for( size_t i = 0; i < sz; ++i ){
+			h ^= (unsigned long long)str[ i ];
+			h *= 0x100000001B3ull;
+		}
+		return hashMix( h ^ sz );
+	}
+
+	// Number parsing straight from UTF-16 code units, no temporary strings.
+	// Leading and trailing spaces are skipped. Returns false if text is not
+	// a number of this type (or does not fit), `out` is not changed then.
+	// Floating point text is xsd:double: INF and NaN, but no hex, inf or nan.
+	template<typename char_type>
+	inline void trimRange( const char_type*& str, const char_type*& end ){
+		while( str < end && isSpace( *str ) ) ++str;
+		while( end > str && isSpace( *(end - 1) ) ) --end;
+	}
+	inline bool parseValue( const char16_t* str, size_t size, bool& out ){
+		const char16_t* end = str + size;
+		trimRange( str, end );
+		size = end - str;
+		if( size == 1 ){
+			if( *str == u'1' ){ out = true; return true; }
+			if( *str == u'0' ){ out = false; return true; }
+		}else if( size == 4 ){
+			if( str[0] == u't' && str[1] == u'r' && str[2] == u'u' && str[3] == u'e' ){ out = true; return true; }
+		}else if( size == 5 ){
+			if( str[0] == u'f' && str[1] == u'a' && str[2] == u'l' && str[3] == u's' && str[4] == u'e' ){ out = false; return true; }
+		}
+		return false;
+	}
+	template<typename T>
+	inline typename std::enable_if<std::is_integral<T>::value, bool>::type
+	parseValue( const char16_t* str, size_t size, T& out ){
+		const char16_t* end = str + size;
+		trimRange( str, end );
+		if( str == end ) return false;
+		bool negative = false;
+		if( *str == u'-' ){
+			if( !std::is_signed<T>::value ) return false;
+			negative = true;
+			++str;
+		}else if( *str == u'+' ) ++str;
+		if( str == end ) return false;
+		typedef typename std::make_unsigned<T>::type U;
+		U limit = negative ? (U)std::numeric_limits<T>::max() + 1u : (U)std::numeric_limits<T>::max();
+		U v = 0;
+		for( ; str < end; ++str ){
+			unsigned int d = (unsigned int)(*str - u'0');
+			if( d > 9 ) return false;
+			if( v > (limit - d) / 10u ) return false;
+			v = v * 10u + d;
+		}
+		out = negative ? (T)(0u - v) : (T)v;
+		return true;
+	}
+	template<typename T>
+	inline typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+	parseValue( const char16_t* str, size_t size, T& out ){
+		static const double pow10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+		const char16_t* end = str + size;
+		trimRange( str, end );
+		if( str == end ) return false;
+		const char16_t* begin = str;
+		bool negative = false;
+		if( *str == u'-' ){
+			negative = true;
+			++str;
+		}else if( *str == u'+' ) ++str;
+		unsigned long long mantissa = 0;
+		unsigned int digits = 0;
+		int exponent = 0;
+		bool any = false;
+		for( ; str < end && isDigit( *str ); ++str ){
+			any = true;
+			if( digits < 19 ){
+				mantissa = mantissa * 10u + (*str - u'0');
+				if( mantissa ) ++digits;
+			}else ++exponent;
+		}
+		if( str < end && *str == u'.' ){
+			++str;
+			for( ; str < end && isDigit( *str ); ++str ){
+				any = true;
+				if( digits < 19 ){
+					mantissa = mantissa * 10u + (*str - u'0');
+					if( mantissa ) ++digits;
+					--exponent;
+				}
+			}
+		}
+		if( !any ){
+			// xsd:double special values
+			size = end - str;
+			if( size == 3 && str[0] == u'I' && str[1] == u'N' && str[2] == u'F' && std::numeric_limits<T>::has_infinity ){
+				out = negative ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::infinity();
+				return true;
+			}
+			if( size == 3 && str == begin && str[0] == u'N' && str[1] == u'a' && str[2] == u'N' && std::numeric_limits<T>::has_quiet_NaN ){
+				out = std::numeric_limits<T>::quiet_NaN();
+				return true;
+			}
+			return false;
+		}
+		if( str < end && (*str == u'e' || *str == u'E') ){
+			++str;
+			bool expNegative = false;
+			if( str < end && (*str == u'-' || *str == u'+') ){
+				expNegative = *str == u'-';
+				++str;
+			}
+			if( str == end || !isDigit( *str ) ) return false;
+			int e = 0;
+			for( ; str < end && isDigit( *str ); ++str ){
+				if( e < 100000 ) e = e * 10 + (*str - u'0');
+			}
+			exponent += expNegative ? -e : e;
+		}
+		if( str != end ) return false;
+		// exact when mantissa and 10^|exponent| are both exact doubles
+		if( digits < 19 && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22 ){
+			double v = (double)mantissa;
+			if( exponent < 0 ) v /= pow10[ -exponent ];
+			else v *= pow10[ exponent ];
+			out = (T)(negative ? -v : v);
+			return true;
+		}
+		// rare: long mantissa or big exponent. Text is checked above, only
+		// ASCII digits, sign, `.` and `e` are left; from_chars does not
+		// depend on locale and does not take leading `+`.
+		if( *begin == u'+' ) ++begin;
+		size = end - begin;
+		char local[ 128 ];
+		kkXMLStringA heap;
+		char* buf = local;
+		if( size > sizeof(local) ){
+			heap.resize( size );
+			buf = &heap[ 0 ];
+		}
+		for( size_t i = 0; i < size; ++i ) buf[ i ] = (char)begin[ i ];
+		T v;
+		std::from_chars_result r = std::from_chars( buf, buf + size, v, std::chars_format::general );
+		if( r.ec != std::errc() || r.ptr != buf + size ) return false;
+		out = v;
+		return true;
+	}
+	template<typename T>
+	inline bool parseValue( const kkXMLString& str, T& out ){
+		return parseValue( str.data(), str.size(), out );
 	}
 }
 
@@ -574,55 +1520,590 @@ enum class kkXPathAxis : unsigned int{
 };
 struct kkXPathToken{
 	kkXPathToken(){}
-	kkXPathToken( kkXPathTokenType type,kkXMLString string,float number )
+	kkXPathToken( kkXPathTokenType type,kkXMLString string,double number )
 	: m_type( type ),m_axis(kkXPathAxis::NONE),m_string( string ),m_number( number ){}
 	kkXPathTokenType    m_type = kkXPathTokenType::NONE;
 	kkXPathAxis         m_axis = kkXPathAxis::NONE;
 	kkXMLString         m_string;
-	float          m_number = 0.f;
+	double         m_number = 0.0;
+	// step `name[@attribute='value']`
+	bool                m_predicate = false;
+	kkXMLString         m_attribute;
+	kkXMLString         m_value;
 };
-struct kkXMLAttribute{
-	kkXMLAttribute(){}
-	kkXMLAttribute( const kkXMLString& Name,const kkXMLString& Value ):name( Name ),value( Value ){}
-	kkXMLString name;
-	kkXMLString value;
+enum class kkXPathFunction : unsigned int{
+	Count,
+	Sum,
+	Min,
+	Max,
+	Boolean,
+	String,
+	NONE = 0xFFFFFFF
 };
-struct kkXMLNode{
-	kkXMLNode(){}
-	kkXMLNode( const kkXMLString& Name ):name( Name ){}
-	kkXMLNode( const kkXMLNode& node ){name = node.name;text = node.text;attributeList = node.attributeList;nodeList = node.nodeList;}
-	~kkXMLNode(){clear();}
-	kkXMLString name;
-	kkXMLString text;
-	kkArray<kkXMLAttribute*> attributeList;
-	kkArray<kkXMLNode*> nodeList;
-	void addAttribute( const kkXMLString& Name,const kkXMLString& Value ){
-		attributeList.push_back( new kkXMLAttribute( Name, Value ) );
-	}
-	void addAttribute( kkXMLAttribute* a ){
-		attributeList.push_back( a );
-	}
-	void addNode( kkXMLNode* node ){
-		nodeList.push_back( node );
+enum class kkXPathValueType : unsigned int{
+	Number,
+	Boolean,
+	String
+};
+// Result of kkXMLDocumentT::Evaluate.
+struct kkXPathValue{
+	kkXPathValueType type = kkXPathValueType::Number;
+	double number = 0.0;
+	bool boolean = false;
+	kkXMLString string;
+	void clear(){
+		type = kkXPathValueType::Number;
+		number = 0.0;
+		boolean = false;
+		string.clear();
 	}
-	kkXMLNode& operator=( const kkXMLNode& node ){
-		name = node.name;
-		text = node.text;
-		attributeList = node.attributeList;
-		nodeList = node.nodeList;
+};
+namespace xmlutil
+{
+	inline bool XPathIsName( const char16_t * ptr ){
+		if( *ptr == u':' ){
+			if( *(ptr + 1) == u':' ) return false;
+		}
+		return !xmlutil::charIs( *ptr, xmlutil::cc_XPathSymbol );
+	}
+	inline const char16_t* XPathGetName( const char16_t*ptr, kkXMLString * name ){
+		while( *ptr ){
+			if( XPathIsName( ptr ) ) *name += *ptr;
+			else break;
+			++ptr;
+		}
+		--ptr;
+		return ptr;
+	}
+	// Sets `error` if given, always returns false.
+	inline bool XPathError( kkXMLError* error, const kkXMLString& XPath_expression, const char16_t* expected, size_t offset = 0 ){
+		if( error ){
+			error->code = kkXMLErrorCode::BadXPath;
+			error->offset = offset;
+			error->expected = expected;
+			error->found = XPath_expression;
+		}
+		return false;
+	}
+	inline bool XPathGetTokens( std::vector<kkXPathToken> * arr, const kkXMLString& XPath_expression, kkXMLError* error = nullptr ){
+		const char16_t * ptr = XPath_expression.data();
+		kkXMLString name;
+		char16_t next;
+		while( *ptr ){		
+			name.clear();
+			next = *(ptr + 1);
+			kkXPathToken token;
+			if( *ptr == u'/' ){
+				if( next ){
+					if( next == u'/' ){
+						++ptr;
+						token.m_type = kkXPathTokenType::Double_slash;
+					}else token.m_type = kkXPathTokenType::Slash;
+				}else token.m_type = kkXPathTokenType::Slash;
+			}else if( *ptr == u'*' ){
+				token.m_type = kkXPathTokenType::Mul;
+			}else if( *ptr == u'=' ){
+				token.m_type = kkXPathTokenType::Equal;
+			}else if( *ptr == u'\'' || *ptr == u'\"' ){
+				// literal is Apos, Name with its text as is, Apos
+				char16_t quote = *ptr;
+				const char16_t* begin = ++ptr;
+				while( *ptr && *ptr != quote ) ++ptr;
+				if( !*ptr ) return XPathError( error, XPath_expression, u"end of literal", ptr - XPath_expression.data() );
+				arr->push_back( kkXPathToken( kkXPathTokenType::Apos, kkXMLString(), 0.0 ) );
+				arr->push_back( kkXPathToken( kkXPathTokenType::Name, kkXMLString( begin, ptr - begin ), 0.0 ) );
+				token.m_type = kkXPathTokenType::Apos;
+			}else if( *ptr == u'@' ){
+				token.m_type = kkXPathTokenType::Attribute;
+			}else if( *ptr == u'|' ){
+				token.m_type = kkXPathTokenType::Bit_or;
+			}else if( *ptr == u',' ){
+				token.m_type = kkXPathTokenType::Comma;
+			}else if( *ptr == u'+' ){
+				token.m_type = kkXPathTokenType::Add;
+			}else if( *ptr == u'+' ){
+				token.m_type = kkXPathTokenType::Sub;
+			}else if( *ptr == u'[' ){
+				token.m_type = kkXPathTokenType::Sq_open;
+			}else if( *ptr == u']' ){
+				token.m_type = kkXPathTokenType::Sq_close;
+			}else if( *ptr == u'(' ){
+				token.m_type = kkXPathTokenType::Function_open;
+			}else if( *ptr == u')' ){
+				token.m_type = kkXPathTokenType::Function_close;
+			}else if( *ptr == u'<' ){
+				if( next ){
+					if( next == u'=' ){
+						++ptr;
+						token.m_type = kkXPathTokenType::Less_eq;
+					}else token.m_type = kkXPathTokenType::Less;
+				}else token.m_type = kkXPathTokenType::Less;
+			}else if( *ptr == u'>' ){
+				if( next ){
+					if( next == u'/' ){
+						++ptr;
+						token.m_type = kkXPathTokenType::More_eq;
+					}else token.m_type = kkXPathTokenType::More;
+				}else token.m_type = kkXPathTokenType::More;
+			}else if( *ptr == u':' ){
+				if( next ){
+					if( next == u':' ){
+						++ptr;
+						token.m_type = kkXPathTokenType::Axis_namespace;
+					}else{
+						return XPathError( error, XPath_expression, u"token", ptr - XPath_expression.data() );
+					}
+				}else{
+					return XPathError( error, XPath_expression, u"token", ptr - XPath_expression.data() );
+				}
+			}else if( *ptr == u'!' ){
+				if( next ){
+					if( next == u'=' ){
+						++ptr;
+						token.m_type = kkXPathTokenType::Not_equal;
+					}else{
+						return XPathError( error, XPath_expression, u"token", ptr - XPath_expression.data() );
+					}
+				}else{
+					return XPathError( error, XPath_expression, u"token", ptr - XPath_expression.data() );
+				}
+			}else if( XPathIsName( ptr ) ){
+				ptr = XPathGetName( ptr, &name );
+				token.m_type = kkXPathTokenType::Name;
+				token.m_string = name;
+			}else{
+				return XPathError( error, XPath_expression, u"token", ptr - XPath_expression.data() );
+			}
+			arr->push_back( token );
+			++ptr;
+		}
+		return true;
+	}
+	// Position of next `|` of union `/a | //b` that is not in a literal, or size.
+	inline size_t XPathFindUnion( const kkXMLString& XPath_expression, size_t pos ){
+		size_t sz = XPath_expression.size();
+		char16_t quote = 0;
+		for( ; pos < sz; ++pos ){
+			char16_t c = XPath_expression[ pos ];
+			if( quote ){
+				if( c == quote ) quote = 0;
+			}else if( c == u'\'' || c == u'\"' ) quote = c;
+			else if( c == u'|' ) break;
+		}
+		return pos;
+	}
+	// Next path of union without spaces around it, `pos` is moved after `|`.
+	inline bool XPathNextUnionPart( const kkXMLString& XPath_expression, size_t& pos, kkXMLString& part ){
+		if( pos > XPath_expression.size() ) return false;
+		size_t begin = pos;
+		size_t end = XPathFindUnion( XPath_expression, pos );
+		pos = end + 1;
+		while( begin < end && XPath_expression[ begin ] == u' ' ) ++begin;
+		while( end > begin && XPath_expression[ end - 1 ] == u' ' ) --end;
+		part.assign( XPath_expression.data() + begin, end - begin );
+		return true;
+	}
+	// `path/@attribute` to `path` and `attribute`, which is empty for
+	// `path`. False for `path/@`.
+	inline bool XPathSplitAttribute( kkXMLString& path, kkXMLString& attribute ){
+		// last `/`, not in a literal
+		size_t slash = kkXMLString::npos;
+		char16_t quote = 0;
+		size_t sz = path.size();
+		for( size_t i = 0; i < sz; ++i ){
+			char16_t c = path[ i ];
+			if( quote ){
+				if( c == quote ) quote = 0;
+			}else if( c == u'\'' || c == u'\"' ) quote = c;
+			else if( c == u'/' ) slash = i;
+		}
+		attribute.clear();
+		if( slash == kkXMLString::npos || slash + 1 >= sz || path[ slash + 1 ] != u'@' ) return true;
+		if( slash + 2 == sz ) return false;
+		attribute.assign( path, slash + 2, kkXMLString::npos );
+		path.resize( slash );
+		return true;
+	}
+	// `function( path )` or `function( path/@attribute )`, see Evaluate.
+	inline bool XPathGetFunction( const kkXMLString& XPath_expression, kkXPathFunction& function, kkXMLString& path, kkXMLString& attribute, kkXMLError* error = nullptr ){
+		const char16_t* begin = XPath_expression.data();
+		const char16_t* end = begin + XPath_expression.size();
+		trimRange( begin, end );
+		const char16_t* open = begin;
+		while( open < end && *open != u'(' ) ++open;
+		if( open == end || *(end - 1) != u')' )
+			return XPathError( error, XPath_expression, u"function( path )", begin - XPath_expression.data() );
+		std::u16string_view name( begin, open - begin );
+		while( name.size() && isSpace( name.back() ) ) name.remove_suffix( 1 );
+		if( name == u"count" ) function = kkXPathFunction::Count;
+		else if( name == u"sum" ) function = kkXPathFunction::Sum;
+		else if( name == u"min" ) function = kkXPathFunction::Min;
+		else if( name == u"max" ) function = kkXPathFunction::Max;
+		else if( name == u"boolean" ) function = kkXPathFunction::Boolean;
+		else if( name == u"string" ) function = kkXPathFunction::String;
+		else return XPathError( error, XPath_expression, u"count, sum, min, max, boolean or string", begin - XPath_expression.data() );
+		const char16_t* ptr = open + 1;
+		--end;
+		trimRange( ptr, end );
+		path.assign( ptr, end - ptr );
+		if( !XPathSplitAttribute( path, attribute ) )
+			return XPathError( error, XPath_expression, u"attribute name", end - XPath_expression.data() );
+		return true;
+	}
+	// `[@attribute='value']` at XPathTokens[ i ], stored in `step`.
+	inline bool XPathGetPredicate( const std::vector<kkXPathToken>& XPathTokens, size_t i, kkXPathToken& step ){
+		static const kkXPathTokenType predicate[] = {
+			kkXPathTokenType::Sq_open, kkXPathTokenType::Attribute, kkXPathTokenType::Name, kkXPathTokenType::Equal,
+			kkXPathTokenType::Apos, kkXPathTokenType::Name, kkXPathTokenType::Apos, kkXPathTokenType::Sq_close
+		};
+		if( i + 8 > XPathTokens.size() ) return false;
+		for( size_t k = 0; k < 8; ++k ){
+			if( XPathTokens[ i + k ].m_type != predicate[ k ] ) return false;
+		}
+		step.m_predicate = true;
+		step.m_attribute = XPathTokens[ i + 2 ].m_string;
+		step.m_value = XPathTokens[ i + 5 ].m_string;
+		return true;
+	}
+	// Absolute location path `/a/b//c[@id='x']`, one name token per step.
+	// m_axis of the token is Child after `/` and Descendant after `//`,
+	// optional attribute equality predicate is stored in the token too.
+	// `elements` points into `XPathTokens`.
+	// Token positions are not kept, so errors after tokenizing have offset 0.
+	inline bool XPathGetPath( const kkXMLString& XPath_expression, std::vector<kkXPathToken>& XPathTokens, kkArray<kkXPathToken*>& elements, kkXMLError* error = nullptr ){
+		XPathTokens.clear();
+		if( !XPathGetTokens( &XPathTokens, XPath_expression, error ) ) return false;
+		elements.clear();
+		unsigned int next = 0;
+		size_t sz = XPathTokens.size();
+		for( size_t i = 0; i < sz; ++i ){
+			next = i + 1;
+			if( i == 0 ){
+				if( XPathTokens[ i ].m_type != kkXPathTokenType::Slash && XPathTokens[ i ].m_type != kkXPathTokenType::Double_slash)
+					return XPathError( error, XPath_expression, u"/" );
+			}
+			switch( XPathTokens[ i ].m_type ){
+				case kkXPathTokenType::Slash:
+				case kkXPathTokenType::Double_slash:
+				if( next >= sz ) return XPathError( error, XPath_expression, u"element name", XPath_expression.size() );
+				if( XPathTokens[ next ].m_type == kkXPathTokenType::Name ){
+					XPathTokens[ next ].m_axis = XPathTokens[ i ].m_type == kkXPathTokenType::Slash
+						? kkXPathAxis::Child : kkXPathAxis::Descendant;
+					elements.push_back( &XPathTokens[ next ] );
+					++i;
+					if( next + 1 < sz && XPathTokens[ next + 1 ].m_type == kkXPathTokenType::Sq_open ){
+						if( !XPathGetPredicate( XPathTokens, next + 1, XPathTokens[ next ] ) )
+							return XPathError( error, XPath_expression, u"[@attribute='value']" );
+						i += 8;
+					}
+				}else return XPathError( error, XPath_expression, u"element name" );
+				break;
+				default:
+				// `|` of union too, callers split unions with XPathNextUnionPart
+				return XPathError( error, XPath_expression, u"/ or //" );
+			}
+		}
+		return true;
+	}
+}
+struct kkXMLNode;
+struct kkXMLChildCursor;
+struct kkXMLPathCursor;
+
+// Lazy node sequence, result of kkXMLNode::nodes and kkXMLDocumentT::Select.
+// Nodes are found while iterating, so first(), any() and take( n ) stop at
+// n-th match instead of collecting all of them. Tree must not be changed
+// while iterating.
+// `Cursor` has start(), next(), done() and get().
+template<typename Cursor>
+class kkXMLRange{
+	Cursor m_cursor;
+	size_t m_limit;
+public:
+	class iterator{
+		Cursor m_cursor;
+		size_t m_left;
+	public:
+		iterator( const Cursor& cursor, size_t left ): m_cursor( cursor ), m_left( left ){
+			if( m_left ) m_cursor.start();
+		}
+		kkXMLNode* operator*() const { return m_cursor.get(); }
+		iterator& operator++(){
+			if( --m_left ) m_cursor.next();
+			return *this;
+		}
+		// only for comparison with end()
+		bool operator!=( const iterator& ) const { return m_left && !m_cursor.done(); }
+		bool operator==( const iterator& other ) const { return !(*this != other); }
+	};
+	kkXMLRange( const Cursor& cursor, size_t limit = (size_t)-1 ): m_cursor( cursor ), m_limit( limit ){}
+	iterator begin() const { return iterator( m_cursor, m_limit ); }
+	iterator end() const { return iterator( m_cursor, 0 ); }
+	// nullptr if there are no nodes
+	kkXMLNode* first() const {
+		iterator it = begin();
+		return it != end() ? *it : nullptr;
+	}
+	bool any() const { return first() != nullptr; }
+	kkXMLRange take( size_t n ) const { return kkXMLRange( m_cursor, n < m_limit ? n : m_limit ); }
+	size_t count() const {
+		size_t n = 0;
+		for( iterator it = begin(), e = end(); it != e; ++it ) ++n;
+		return n;
+	}
+	void toArray( kkArray<kkXMLNode*>& out ) const {
+		out.clear();
+		for( kkXMLNode* node : *this ) out.push_back( node );
+	}
+};
+
+struct kkXMLAttribute{
+	kkXMLAttribute(){}
+	kkXMLAttribute( const kkXMLString& Name,const kkXMLString& Value ):name( Name ),value( Value ){}
+	kkXMLString name;
+	kkXMLString value;
+};
+struct kkXMLNode{
+	kkXMLNode(){}
+	kkXMLNode( const kkXMLString& Name ):name( Name ){}
+	kkXMLNode( const kkXMLNode& node ){copyFrom( node );}
+	kkXMLNode( kkXMLNode&& node ) noexcept
+	: name( std::move( node.name ) ), text( std::move( node.text ) ),
+	attributeList( std::move( node.attributeList ) ), nodeList( std::move( node.nodeList ) ){
+		node.attributeList.clear();
+		node.nodeList.clear();
+		moveState( node );
+	}
+	~kkXMLNode(){freeChildren();}
+	kkXMLString name;
+	kkXMLString text;
+	kkArray<kkXMLAttribute*> attributeList;
+	kkArray<kkXMLNode*> nodeList;
+	kkXMLNode* parent = nullptr;
+
+	// Position of this element in kkXMLDocument source text, [begin, end).
+	// Used by kkXMLDocument::Write to copy unchanged subtrees verbatim.
+	size_t m_sourceBegin = 0;
+	size_t m_sourceEnd = 0;
+	bool m_dirty = false;        // name, attributes, text or child list changed
+	bool m_subtreeDirty = false; // this node or any descendant is dirty
+	unsigned int m_version = 0;  // only for root: number of changes in the tree, for indexes
+	size_t m_pre = 0;      // pre-order and post-order numbers, see isAncestorOf
+	size_t m_post = 0;
+	unsigned long long m_hash = 0; // see hash()
+	bool m_hashValid = false;
+
+	// Changes made through the methods below are tracked.
+	// Direct changes of public fields are not.
+	void addAttribute( const kkXMLString& Name,const kkXMLString& Value ){
+		attributeList.push_back( kkCreate(kkXMLAttribute)( Name, Value ) );
+		markDirty();
+	}
+	void addAttribute( kkXMLAttribute* a ){
+		attributeList.push_back( a );
+		markDirty();
+	}
+	void addNode( kkXMLNode* node ){
+		insertNode( node, nodeList.size() );
+	}
+	void setAttribute( const kkXMLString& Name, const kkXMLString& Value ){
+		kkXMLAttribute* a = getAttribute( Name );
+		if( a ){
+			if( a->value == Value ) return;
+			a->value = Value;
+			markDirty();
+		}else addAttribute( Name, Value );
+	}
+	bool removeAttribute( const kkXMLString& Name ){
+		size_t sz = attributeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			if( attributeList[ i ]->name == Name ){
+				kkDestroy(attributeList[ i ]);
+				attributeList.erase( attributeList.begin() + i );
+				markDirty();
+				return true;
+			}
+		}
+		return false;
+	}
+	void setText( const kkXMLString& Text ){
+		if( text == Text ) return;
+		text = Text;
+		markDirty();
+	}
+	// Takes ownership. `node` must not have a parent.
+	void insertNode( kkXMLNode* node, size_t index ){
+		if( index > nodeList.size() ) index = nodeList.size();
+		node->parent = this;
+		// source offsets may belong to another document
+		node->resetSource();
+		nodeList.insert( nodeList.begin() + index, node );
+		markDirty();
+	}
+	// Detaches child, caller owns it after that.
+	kkXMLNode* removeNode( kkXMLNode* node ){
+		size_t sz = nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			if( nodeList[ i ] == node ){
+				nodeList.erase( nodeList.begin() + i );
+				node->parent = nullptr;
+				markDirty();
+				return node;
+			}
+		}
+		return nullptr;
+	}
+	// Changes position of child. Source of the child stays valid.
+	bool moveNode( kkXMLNode* node, size_t newIndex ){
+		size_t sz = nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			if( nodeList[ i ] == node ){
+				if( newIndex >= sz ) newIndex = sz - 1;
+				if( newIndex == i ) return true;
+				nodeList.erase( nodeList.begin() + i );
+				nodeList.insert( nodeList.begin() + newIndex, node );
+				markDirty();
+				return true;
+			}
+		}
+		return false;
+	}
+	void markDirty(){
+		m_dirty = true;
+		kkXMLNode* n = this;
+		for( ; n->parent; n = n->parent ){
+			n->m_subtreeDirty = true;
+			n->m_hashValid = false;
+		}
+		n->m_subtreeDirty = true;
+		n->m_hashValid = false;
+		++n->m_version;
+	}
+	// Structural hash of name, attributes (in any order), text and children.
+	// Equal subtrees have equal hashes. Kept until the subtree is changed
+	// through methods of kkXMLNode; parser computes it with Policy::hashNodes.
+	unsigned long long hash(){
+		if( !m_hashValid ){
+			size_t sz = nodeList.size();
+			for( size_t i = 0; i < sz; ++i ) nodeList[ i ]->hash();
+			updateHash();
+		}
+		return m_hash;
+	}
+	// From hashes of children, they must be valid.
+	void updateHash(){
+		unsigned long long h = xmlutil::hashString( 0xCBF29CE484222325ull, name );
+		unsigned long long attributes = 0;
+		size_t sz = attributeList.size();
+		for( size_t i = 0; i < sz; ++i )
+			attributes += xmlutil::hashString( xmlutil::hashString( 1, attributeList[ i ]->name ), attributeList[ i ]->value );
+		h = xmlutil::hashMix( h ^ attributes );
+		h = xmlutil::hashString( h, text );
+		sz = nodeList.size();
+		for( size_t i = 0; i < sz; ++i ) h = xmlutil::hashMix( h + nodeList[ i ]->m_hash );
+		m_hash = xmlutil::hashMix( h ^ sz );
+		m_hashValid = true;
+	}
+	// Same name, attributes, text and children, by hash.
+	bool sameAs( kkXMLNode* node ){ return hash() == node->hash(); }
+	bool hasSource() const { return m_sourceEnd > m_sourceBegin; }
+	// Axis tests by order numbers. Numbers are set by parser and by
+	// kkXMLDocumentT::UpdateOrder after the tree is changed.
+	bool isAncestorOf( const kkXMLNode* node ) const { return m_pre < node->m_pre && node->m_post < m_post; }
+	bool isDescendantOf( const kkXMLNode* node ) const { return node->isAncestorOf( this ); }
+	// `preceding` axis of `node`: before it in document order and not its ancestor.
+	bool isPrecedingOf( const kkXMLNode* node ) const { return m_pre < node->m_pre && m_post < node->m_post; }
+	bool isFollowingOf( const kkXMLNode* node ) const { return node->isPrecedingOf( this ); }
+	bool isBefore( const kkXMLNode* node ) const { return m_pre < node->m_pre; }
+	void resetSource(){
+		m_sourceBegin = m_sourceEnd = 0;
+		m_dirty = m_subtreeDirty = false;
+		size_t sz = nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			nodeList[ i ]->resetSource();
+		}
+	}
+	void moveState( kkXMLNode& node ){
+		m_sourceBegin = node.m_sourceBegin;
+		m_sourceEnd = node.m_sourceEnd;
+		m_dirty = node.m_dirty;
+		m_subtreeDirty = node.m_subtreeDirty;
+		m_hash = node.m_hash;
+		m_hashValid = node.m_hashValid;
+		size_t sz = nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			nodeList[ i ]->parent = this;
+		}
+	}
+	kkXMLNode& operator=( const kkXMLNode& node ){
+		if( this != &node ){
+			clear();
+			copyFrom( node );
+		}
+		return *this;
+	}
+	kkXMLNode& operator=( kkXMLNode&& node ) noexcept {
+		if( this != &node ){
+			clear();
+			name = std::move( node.name );
+			text = std::move( node.text );
+			attributeList = std::move( node.attributeList );
+			nodeList = std::move( node.nodeList );
+			node.attributeList.clear();
+			node.nodeList.clear();
+			moveState( node );
+		}
 		return *this;
 	}
+	// Deep copy. Children and attributes are owned, so they must never be shared.
+	void copyFrom( const kkXMLNode& node ){
+		name = node.name;
+		text = node.text;
+		m_sourceBegin = node.m_sourceBegin;
+		m_sourceEnd = node.m_sourceEnd;
+		m_dirty = node.m_dirty;
+		m_subtreeDirty = node.m_subtreeDirty;
+		m_hash = node.m_hash;
+		m_hashValid = node.m_hashValid;
+		size_t sz = node.attributeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			attributeList.push_back( kkCreate(kkXMLAttribute)( *node.attributeList[ i ] ) );
+		}
+		sz = node.nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			nodeList.push_back( node.nodeList[ i ]->clone() );
+			nodeList.back()->parent = this;
+		}
+	}
+	kkXMLNode* clone() const {
+		kkXMLNode* node = kkCreate(kkXMLNode)();
+		node->copyFrom( *this );
+		return node;
+	}
 	kkXMLAttribute*	getAttribute( const kkXMLString& Name ){
-		unsigned int sz = (unsigned int)attributeList.size();
-		for( unsigned int i = 0; i < sz; ++i ){
+		size_t sz = attributeList.size();
+		for( size_t i = 0; i < sz; ++i ){
 			if( attributeList[ i ]->name == Name )
 				return attributeList[ i ];
 		}
 		return nullptr;
 	}
+	// Value of attribute converted to bool, integer or floating point type,
+	// `defaultValue` if there is no such attribute or it is not a number.
+	template<typename T>
+	T	getAttributeAs( const kkXMLString& Name, T defaultValue ){
+		kkXMLAttribute* a = getAttribute( Name );
+		if( a ) xmlutil::parseValue( a->value, defaultValue );
+		return defaultValue;
+	}
+	template<typename T>
+	T	textAs( T defaultValue = T() ) const {
+		xmlutil::parseValue( text, defaultValue );
+		return defaultValue;
+	}
 	kkXMLNode*	getNode( const kkXMLString& Name ){
-		unsigned int sz = (unsigned int)nodeList.size();
-		for( unsigned int i = 0; i < sz; ++i ){
+		size_t sz = nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
 			if( nodeList[ i ]->name == Name )
 				return nodeList[ i ];
 		}
@@ -630,25 +2111,38 @@ struct kkXMLNode{
 	}
 	kkArray<kkXMLNode*>	getNodes( const kkXMLString& Name ){
 		kkArray<kkXMLNode*> arr;
-		unsigned int sz = (unsigned int)nodeList.size();
-		for( unsigned int i = 0; i < sz; ++i ){
+		getNodes( Name, arr );
+		return arr;
+	}
+	// Lazy variant of getNodes. The range keeps its own copy of `Name`.
+	kkXMLRange<kkXMLChildCursor> nodes( const kkXMLString& Name );
+	// Same as above, but fills caller's array. `out` is cleared, capacity is kept.
+	void	getNodes( const kkXMLString& Name, kkArray<kkXMLNode*>& out ){
+		out.clear();
+		size_t sz = nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
 			auto node = nodeList[ i ];
 			if( node->name == Name )
 			{
-				arr.push_back(node);
+				out.push_back(node);
 			}
 		}
-		return arr;
 	}
+	// Indexes of the document are built again after it. Source range is
+	// kept, so Write puts the node in its old place.
 	void clear(){
 		name.clear();
 		text.clear();
-		unsigned int sz = (unsigned int)attributeList.size();
-		for( unsigned int i = 0; i < sz; ++i ){
+		freeChildren();
+		markDirty();
+	}
+	void freeChildren(){
+		size_t sz = attributeList.size();
+		for( size_t i = 0; i < sz; ++i ){
 			kkDestroy(attributeList[ i ]);
 		}
-		sz =  (unsigned int)nodeList.size();
-		for( unsigned int i = 0; i < sz; ++i ){
+		sz = nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
 			kkDestroy(nodeList[ i ]);
 		}
 		attributeList.clear();
@@ -656,106 +2150,1110 @@ struct kkXMLNode{
 	}
 };
 
-class kkXMLDocument{
+// Result of kkXMLDiff. `a` is node of first tree, `b` of second one.
+enum class kkXMLChangeType : unsigned int{
+	NodeAdded,			// b is new, a is its parent (nullptr for root)
+	NodeRemoved,		// a is removed, b is its parent (nullptr for root)
+	AttributeAdded,		// `name` of b
+	AttributeRemoved,	// `name` of a
+	AttributeChanged,
+	TextChanged
+};
+struct kkXMLChange{
+	kkXMLChangeType type = kkXMLChangeType::NodeAdded;
+	kkXMLNode* a = nullptr;
+	kkXMLNode* b = nullptr;
+	kkXMLString name; // attribute
+};
+
+namespace xmlutil
+{
+	inline void diffNodes( kkXMLNode* a, kkXMLNode* b, kkArray<kkXMLChange>& out );
+	inline void addChange( kkArray<kkXMLChange>& out, kkXMLChangeType type, kkXMLNode* a, kkXMLNode* b ){
+		out.push_back( kkXMLChange() );
+		out.back().type = type;
+		out.back().a = a;
+		out.back().b = b;
+	}
+	// Children in [ a0, a1 ) and [ b0, b1 ) with no equal subtrees between
+	// them. Same names are paired in order, others are removed and added.
+	inline void diffGap( kkXMLNode* a, size_t a0, size_t a1, kkXMLNode* b, size_t b0, size_t b1,
+		kkArray<bool>& used, kkArray<kkXMLChange>& out ){
+		for( size_t i = a0; i < a1; ++i ){
+			kkXMLNode* child = a->nodeList[ i ];
+			size_t k = b0;
+			while( k < b1 && ( used[ k ] || b->nodeList[ k ]->name != child->name ) ) ++k;
+			if( k < b1 ){
+				used[ k ] = true;
+				diffNodes( child, b->nodeList[ k ], out );
+			}else addChange( out, kkXMLChangeType::NodeRemoved, child, b );
+		}
+		for( size_t k = b0; k < b1; ++k ){
+			if( !used[ k ] ) addChange( out, kkXMLChangeType::NodeAdded, a, b->nodeList[ k ] );
+		}
+	}
+	inline void diffChildren( kkXMLNode* a, kkXMLNode* b, kkArray<kkXMLChange>& out ){
+		kkArray<kkXMLNode*>& ac = a->nodeList;
+		kkArray<kkXMLNode*>& bc = b->nodeList;
+		// equal prefix and suffix, usual case for few changes
+		size_t begin = 0;
+		size_t aEnd = ac.size();
+		size_t bEnd = bc.size();
+		while( begin < aEnd && begin < bEnd && ac[ begin ]->hash() == bc[ begin ]->hash() ) ++begin;
+		while( aEnd > begin && bEnd > begin && ac[ aEnd - 1 ]->hash() == bc[ bEnd - 1 ]->hash() ){
+			--aEnd;
+			--bEnd;
+		}
+		// equal subtrees in the middle are anchors, kept in order
+		kkArray<std::pair<unsigned long long, size_t>> byHash;
+		for( size_t k = begin; k < bEnd; ++k ) byHash.push_back( { bc[ k ]->hash(), k } );
+		std::sort( byHash.begin(), byHash.end() );
+		kkArray<bool> used( bc.size(), false );
+		size_t a0 = begin;
+		size_t b0 = begin;
+		for( size_t i = begin; i < aEnd; ++i ){
+			auto it = std::lower_bound( byHash.begin(), byHash.end(), std::make_pair( ac[ i ]->hash(), b0 ) );
+			if( it == byHash.end() || it->first != ac[ i ]->hash() ) continue;
+			diffGap( a, a0, i, b, b0, it->second, used, out );
+			used[ it->second ] = true;
+			a0 = i + 1;
+			b0 = it->second + 1;
+		}
+		diffGap( a, a0, aEnd, b, b0, bEnd, used, out );
+	}
+	inline void diffNodes( kkXMLNode* a, kkXMLNode* b, kkArray<kkXMLChange>& out ){
+		if( a->hash() == b->hash() ) return;
+		if( a->name != b->name ){
+			addChange( out, kkXMLChangeType::NodeRemoved, a, b->parent );
+			addChange( out, kkXMLChangeType::NodeAdded, a->parent, b );
+			return;
+		}
+		for( auto * at : a->attributeList ){
+			kkXMLAttribute* other = b->getAttribute( at->name );
+			if( !other ){
+				addChange( out, kkXMLChangeType::AttributeRemoved, a, b );
+				out.back().name = at->name;
+			}else if( other->value != at->value ){
+				addChange( out, kkXMLChangeType::AttributeChanged, a, b );
+				out.back().name = at->name;
+			}
+		}
+		for( auto * at : b->attributeList ){
+			if( !a->getAttribute( at->name ) ){
+				addChange( out, kkXMLChangeType::AttributeAdded, a, b );
+				out.back().name = at->name;
+			}
+		}
+		if( a->text != b->text ) addChange( out, kkXMLChangeType::TextChanged, a, b );
+		diffChildren( a, b, out );
+	}
+}
+
+// Changes that turn tree `a` into tree `b`. Only subtrees with different
+// hashes are visited. Moved elements are reported as removed and added.
+inline void kkXMLDiff( kkXMLNode* a, kkXMLNode* b, kkArray<kkXMLChange>& out ){
+	out.clear();
+	xmlutil::diffNodes( a, b, out );
+}
+
+// Children with given name
+struct kkXMLChildCursor{
+	kkXMLNode* m_parent;
+	kkXMLString m_name;
+	size_t m_index = 0;
+	kkXMLChildCursor( kkXMLNode* parent, const kkXMLString& Name ): m_parent( parent ), m_name( Name ){}
+	void start(){
+		m_index = 0;
+		skip();
+	}
+	void next(){
+		++m_index;
+		skip();
+	}
+	void skip(){
+		size_t sz = m_parent->nodeList.size();
+		while( m_index < sz && m_name != m_parent->nodeList[ m_index ]->name ) ++m_index;
+	}
+	bool done() const { return m_index >= m_parent->nodeList.size(); }
+	kkXMLNode* get() const { return m_parent->nodeList[ m_index ]; }
+};
+inline kkXMLRange<kkXMLChildCursor> kkXMLNode::nodes( const kkXMLString& Name ){
+	return kkXMLRange<kkXMLChildCursor>( kkXMLChildCursor( this, Name ) );
+}
+
+namespace xmlutil
+{
+	// Sorts by unsigned key( item ), document order number, and removes items
+	// with the same key. LSD radix sort, 8 bits per pass; passes where all
+	// keys have the same digit, or above the biggest key, are skipped.
+	// `tmp` is scratch.
+	template<typename T, typename Key>
+	inline void sortUnique( kkArray<T>& items, kkArray<T>& tmp, Key key ){
+		size_t sz = items.size();
+		if( sz < 2 ) return;
+		tmp.resize( sz );
+		auto maxKey = key( items[ 0 ] );
+		for( size_t i = 1; i < sz; ++i ){
+			if( key( items[ i ] ) > maxKey ) maxKey = key( items[ i ] );
+		}
+		size_t count[ 256 ];
+		for( u32 shift = 0; shift < sizeof( maxKey ) * 8 && (maxKey >> shift); shift += 8 ){
+			for( u32 d = 0; d < 256; ++d ) count[ d ] = 0;
+			for( size_t i = 0; i < sz; ++i ) ++count[ (key( items[ i ] ) >> shift) & 0xFF ];
+			if( count[ (key( items[ 0 ] ) >> shift) & 0xFF ] == sz ) continue;
+			size_t sum = 0;
+			for( u32 d = 0; d < 256; ++d ){
+				size_t c = count[ d ];
+				count[ d ] = sum;
+				sum += c;
+			}
+			for( size_t i = 0; i < sz; ++i ) tmp[ count[ (key( items[ i ] ) >> shift) & 0xFF ]++ ] = items[ i ];
+			items.swap( tmp );
+		}
+		size_t out = 1;
+		for( size_t i = 1; i < sz; ++i ){
+			if( key( items[ i ] ) != key( items[ out - 1 ] ) ) items[ out++ ] = items[ i ];
+		}
+		items.resize( out );
+	}
+	inline const kkXPathToken& XPathStep( const kkXPathToken& t ){ return t; }
+	inline const kkXPathToken& XPathStep( const kkXPathToken* t ){ return *t; }
+	// Name and predicate of the step, not its axis.
+	inline bool XPathMatchStep( const kkXMLNode* node, const kkXPathToken& step ){
+		if( node->name != step.m_string ) return false;
+		if( !step.m_predicate ) return true;
+		size_t sz = node->attributeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			if( node->attributeList[ i ]->name == step.m_attribute )
+				return node->attributeList[ i ]->value == step.m_value;
+		}
+		return false;
+	}
+	// `node` is matched by steps[ last ] of absolute path, checks that its
+	// ancestors match the steps before.
+	template<typename Steps>
+	inline bool XPathMatchAncestors( const kkXMLNode* node, const Steps& steps, size_t last ){
+		const kkXMLNode* p = node->parent;
+		if( XPathStep( steps[ last ] ).m_axis == kkXPathAxis::Descendant ){
+			if( !last ) return true;
+			for( ; p; p = p->parent ){
+				if( XPathMatchStep( p, XPathStep( steps[ last - 1 ] ) ) && XPathMatchAncestors( p, steps, last - 1 ) )
+					return true;
+			}
+			return false;
+		}
+		if( !last ) return !p;
+		return p && XPathMatchStep( p, XPathStep( steps[ last - 1 ] ) ) && XPathMatchAncestors( p, steps, last - 1 );
+	}
+}
+
+// Nodes on absolute path, in document order. Path of `/` steps only is
+// walked along matching names, with `//` steps whole tree is walked.
+// Union `/a | //b` has one cursor per path and merges them by m_pre,
+// so order numbers must be up to date, see kkXMLDocumentT::UpdateOrder.
+struct kkXMLPathCursor{
+	kkXMLNode* m_root = nullptr; // nullptr - empty
+	std::shared_ptr<const kkArray<kkXPathToken>> m_path;
+	std::vector<kkXMLPathCursor> m_branches; // paths of union
+	bool m_descendant = false; // path has `//` steps
+	// nodes matched by m_path[ 0 ] ... m_path[ level ] (or all nodes on the
+	// way, with m_descendant), and next child to try
+	kkArray<kkXMLNode*> m_nodes;
+	kkArray<size_t> m_next;
+	kkXMLNode* m_current = nullptr;
+	kkXMLPathCursor(){}
+	kkXMLPathCursor( kkXMLNode* root, std::shared_ptr<const kkArray<kkXPathToken>> path )
+	: m_root( root ), m_path( std::move( path ) ){
+		size_t sz = m_path->size();
+		for( size_t i = 0; i < sz; ++i )
+			if( (*m_path)[ i ].m_axis == kkXPathAxis::Descendant ) m_descendant = true;
+	}
+	explicit kkXMLPathCursor( std::vector<kkXMLPathCursor> branches ): m_branches( std::move( branches ) ){}
+	bool matches( const kkXMLNode* node ) const {
+		size_t last = m_path->size() - 1;
+		return xmlutil::XPathMatchStep( node, (*m_path)[ last ] ) && xmlutil::XPathMatchAncestors( node, *m_path, last );
+	}
+	void start(){
+		m_nodes.clear();
+		m_next.clear();
+		m_current = nullptr;
+		if( m_branches.size() ){
+			for( kkXMLPathCursor& branch : m_branches ) branch.start();
+			pickBranch();
+			return;
+		}
+		if( !m_root || !m_path->size() ) return;
+		if( m_descendant ){
+			m_nodes.push_back( m_root );
+			m_next.push_back( 0 );
+			if( matches( m_root ) ) m_current = m_root;
+			else next();
+			return;
+		}
+		if( !xmlutil::XPathMatchStep( m_root, (*m_path)[ 0 ] ) ) return;
+		if( m_path->size() == 1 ){
+			m_current = m_root;
+			return;
+		}
+		m_nodes.push_back( m_root );
+		m_next.push_back( 0 );
+		next();
+	}
+	void next(){
+		if( m_branches.size() ){
+			// node found by several paths is given once
+			for( kkXMLPathCursor& branch : m_branches )
+				if( branch.m_current == m_current ) branch.next();
+			pickBranch();
+			return;
+		}
+		const kkArray<kkXPathToken>& path = *m_path;
+		m_current = nullptr;
+		while( m_nodes.size() ){
+			size_t level = m_nodes.size() - 1;
+			kkXMLNode* node = m_nodes[ level ];
+			size_t i = m_next[ level ]++;
+			if( i >= node->nodeList.size() ){
+				m_nodes.pop_back();
+				m_next.pop_back();
+				continue;
+			}
+			kkXMLNode* child = node->nodeList[ i ];
+			if( m_descendant ){
+				if( child->nodeList.size() ){
+					m_nodes.push_back( child );
+					m_next.push_back( 0 );
+				}
+				if( matches( child ) ){
+					m_current = child;
+					return;
+				}
+				continue;
+			}
+			if( !xmlutil::XPathMatchStep( child, path[ level + 1 ] ) ) continue;
+			if( level + 2 == path.size() ){
+				m_current = child;
+				return;
+			}
+			m_nodes.push_back( child );
+			m_next.push_back( 0 );
+		}
+	}
+	// first in document order of current nodes of branches
+	void pickBranch(){
+		m_current = nullptr;
+		for( const kkXMLPathCursor& branch : m_branches ){
+			if( branch.m_current && (!m_current || branch.m_current->m_pre < m_current->m_pre) )
+				m_current = branch.m_current;
+		}
+	}
+	bool done() const { return !m_current; }
+	kkXMLNode* get() const { return m_current; }
+};
+
+// Compact, read-only representation of a node tree.
+// Nodes are stored in document order as structure of arrays and addressed
+// by 32-bit handles, so up to 2^32 - 1 nodes. Element and attribute names
+// are atoms, text and values live in one character pool.
+// 32-bit limits, build fails above them instead of wrapping:
+//	nodes			kkXMLCompactTree::maxNodes (handles, kkXMLFrozenDocument too)
+//	distinct names	kkXMLAtomTable::maxAtoms
+//	attributes of one node	2^32 - 1
+// Text pool, attribute table and kkXMLDocument trees are not limited.
+typedef u32 kkXMLHandle;
+const kkXMLHandle kkXMLInvalidHandle = 0xFFFFFFFF;
+
+struct kkXMLStringRef{
+	size_t offset = 0;
+	size_t size = 0;
+};
+
+class kkXMLAtomTable{
+	kkXMLString m_chars;
+	kkArray<kkXMLStringRef> m_atoms;
+	kkArray<u32> m_slots; // open addressing, kkXMLInvalidHandle = empty
+	static u32 hash( const char16_t* str, size_t size ){
+		u32 h = 2166136261u;
+		for( size_t i = 0; i < size; ++i ){
+			h ^= (u32)str[ i ];
+			h *= 16777619u;
+		}
+		return h;
+	}
+	bool equal( u32 atom, const char16_t* str, size_t size ) const {
+		const kkXMLStringRef& r = m_atoms[ atom ];
+		if( r.size != size ) return false;
+		for( size_t i = 0; i < size; ++i ){
+			if( m_chars[ r.offset + i ] != str[ i ] ) return false;
+		}
+		return true;
+	}
+	void rehash(){
+		u32 newSize = m_slots.size() ? (u32)m_slots.size() * 2 : 64;
+		m_slots.clear();
+		m_slots.resize( newSize, kkXMLInvalidHandle );
+		u32 mask = newSize - 1;
+		u32 sz = (u32)m_atoms.size();
+		for( u32 i = 0; i < sz; ++i ){
+			u32 slot = hash( m_chars.data() + m_atoms[ i ].offset, m_atoms[ i ].size ) & mask;
+			while( m_slots[ slot ] != kkXMLInvalidHandle ) slot = (slot + 1) & mask;
+			m_slots[ slot ] = i;
+		}
+	}
+public:
+	// slot count is u32 and at least twice the atom count
+	static constexpr u32 maxAtoms = 1u << 30;
+	u32 find( const char16_t* str, size_t size ) const {
+		if( !m_slots.size() ) return kkXMLInvalidHandle;
+		u32 mask = (u32)m_slots.size() - 1;
+		u32 slot = hash( str, size ) & mask;
+		while( m_slots[ slot ] != kkXMLInvalidHandle ){
+			if( equal( m_slots[ slot ], str, size ) ) return m_slots[ slot ];
+			slot = (slot + 1) & mask;
+		}
+		return kkXMLInvalidHandle;
+	}
+	u32 find( const kkXMLString& str ) const { return find( str.data(), str.size() ); }
+	// kkXMLInvalidHandle if there are maxAtoms atoms and `str` is new.
+	u32 intern( const char16_t* str, size_t size ){
+		bool full = m_atoms.size() >= maxAtoms;
+		// when full, table is half empty and only finds old atoms
+		if( !full && (m_atoms.size() + 1) * 2 > m_slots.size() ) rehash();
+		u32 mask = (u32)m_slots.size() - 1;
+		u32 slot = hash( str, size ) & mask;
+		while( m_slots[ slot ] != kkXMLInvalidHandle ){
+			if( equal( m_slots[ slot ], str, size ) ) return m_slots[ slot ];
+			slot = (slot + 1) & mask;
+		}
+		if( full ) return kkXMLInvalidHandle;
+		kkXMLStringRef r;
+		r.offset = m_chars.size();
+		r.size = size;
+		m_chars.append( str, size );
+		m_slots[ slot ] = (u32)m_atoms.size();
+		m_atoms.push_back( r );
+		return m_slots[ slot ];
+	}
+	u32 intern( const kkXMLString& str ){ return intern( str.data(), str.size() ); }
+	std::u16string_view get( u32 atom ) const {
+		const kkXMLStringRef& r = m_atoms[ atom ];
+		return std::u16string_view( m_chars.data() + r.offset, r.size );
+	}
+	u32 size() const { return (u32)m_atoms.size(); }
+	void clear(){
+		m_chars.clear();
+		m_atoms.clear();
+		m_slots.clear();
+	}
+};
+
+class kkXMLCompactTree{
+	// node table, index = handle, document order
+	kkArray<u32> m_name;
+	kkArray<kkXMLStringRef> m_text;
+	kkArray<u32> m_parent;
+	kkArray<u32> m_firstChild;
+	kkArray<u32> m_nextSibling;
+	kkArray<size_t> m_firstAttribute;
+	kkArray<u32> m_attributeCount;
+	// attribute table
+	kkArray<u32> m_attributeName;
+	kkArray<kkXMLStringRef> m_attributeValue;
+
+	kkXMLAtomTable m_atoms;
+	kkXMLString m_pool;
+
+	kkXMLStringRef addString( const kkXMLString& str ){
+		kkXMLStringRef r;
+		r.offset = m_pool.size();
+		r.size = str.size();
+		m_pool += str;
+		return r;
+	}
+	// kkXMLInvalidHandle when a limit is reached.
+	kkXMLHandle addNode( const kkXMLNode* node, kkXMLHandle parent ){
+		if( m_name.size() >= maxNodes || node->attributeList.size() >= 0xFFFFFFFFu ) return kkXMLInvalidHandle;
+		kkXMLHandle h = (kkXMLHandle)m_name.size();
+		u32 name = m_atoms.intern( node->name );
+		if( name == kkXMLInvalidHandle ) return kkXMLInvalidHandle;
+		m_name.push_back( name );
+		m_text.push_back( addString( node->text ) );
+		m_parent.push_back( parent );
+		m_firstChild.push_back( kkXMLInvalidHandle );
+		m_nextSibling.push_back( kkXMLInvalidHandle );
+		m_firstAttribute.push_back( m_attributeName.size() );
+		u32 sz = (u32)node->attributeList.size();
+		m_attributeCount.push_back( sz );
+		for( u32 i = 0; i < sz; ++i ){
+			u32 atom = m_atoms.intern( node->attributeList[ i ]->name );
+			if( atom == kkXMLInvalidHandle ) return kkXMLInvalidHandle;
+			m_attributeName.push_back( atom );
+			m_attributeValue.push_back( addString( node->attributeList[ i ]->value ) );
+		}
+		kkXMLHandle prev = kkXMLInvalidHandle;
+		size_t count = node->nodeList.size();
+		for( size_t i = 0; i < count; ++i ){
+			kkXMLHandle child = addNode( node->nodeList[ i ], h );
+			if( child == kkXMLInvalidHandle ) return kkXMLInvalidHandle;
+			if( prev == kkXMLInvalidHandle ) m_firstChild[ h ] = child;
+			else m_nextSibling[ prev ] = child;
+			prev = child;
+		}
+		return h;
+	}
+	std::u16string_view view( const kkXMLStringRef& r ) const {
+		return std::u16string_view( m_pool.data() + r.offset, r.size );
+	}
+public:
+	// kkXMLInvalidHandle is not a node
+	static constexpr size_t maxNodes = 0xFFFFFFFFu;
+	kkXMLCompactTree(){}
+	kkXMLCompactTree( const kkXMLNode* root ){ build( root ); }
+
+	// Root is always handle 0. False, and empty tree, if the tree has more
+	// than maxNodes nodes or maxAtoms names.
+	bool build( const kkXMLNode* root ){
+		clear();
+		if( addNode( root, kkXMLInvalidHandle ) != kkXMLInvalidHandle ) return true;
+		clear();
+		return false;
+	}
+	void clear(){
+		m_name.clear();
+		m_text.clear();
+		m_parent.clear();
+		m_firstChild.clear();
+		m_nextSibling.clear();
+		m_firstAttribute.clear();
+		m_attributeCount.clear();
+		m_attributeName.clear();
+		m_attributeValue.clear();
+		m_atoms.clear();
+		m_pool.clear();
+	}
+	u32 size() const { return (u32)m_name.size(); }
+	kkXMLHandle getRoot() const { return size() ? 0 : kkXMLInvalidHandle; }
+	kkXMLHandle getParent( kkXMLHandle h ) const { return m_parent[ h ]; }
+	kkXMLHandle getFirstChild( kkXMLHandle h ) const { return m_firstChild[ h ]; }
+	kkXMLHandle getNextSibling( kkXMLHandle h ) const { return m_nextSibling[ h ]; }
+	std::u16string_view getName( kkXMLHandle h ) const { return m_atoms.get( m_name[ h ] ); }
+	std::u16string_view getText( kkXMLHandle h ) const { return view( m_text[ h ] ); }
+	u32 getNameAtom( kkXMLHandle h ) const { return m_name[ h ]; }
+	const kkXMLAtomTable& getAtoms() const { return m_atoms; }
+	u32 getAttributeCount( kkXMLHandle h ) const { return m_attributeCount[ h ]; }
+	std::u16string_view getAttributeName( kkXMLHandle h, u32 index ) const {
+		return m_atoms.get( m_attributeName[ m_firstAttribute[ h ] + index ] );
+	}
+	std::u16string_view getAttributeValue( kkXMLHandle h, u32 index ) const {
+		return view( m_attributeValue[ m_firstAttribute[ h ] + index ] );
+	}
+	// Returns false if node has no such attribute.
+	bool getAttribute( kkXMLHandle h, const kkXMLString& Name, std::u16string_view& outValue ) const {
+		u32 atom = m_atoms.find( Name );
+		if( atom == kkXMLInvalidHandle ) return false;
+		size_t first = m_firstAttribute[ h ];
+		size_t last = first + m_attributeCount[ h ];
+		for( size_t i = first; i < last; ++i ){
+			if( m_attributeName[ i ] == atom ){
+				outValue = view( m_attributeValue[ i ] );
+				return true;
+			}
+		}
+		return false;
+	}
+	kkXMLHandle getNode( kkXMLHandle h, const kkXMLString& Name ) const {
+		u32 atom = m_atoms.find( Name );
+		if( atom == kkXMLInvalidHandle ) return kkXMLInvalidHandle;
+		for( kkXMLHandle c = m_firstChild[ h ]; c != kkXMLInvalidHandle; c = m_nextSibling[ c ] ){
+			if( m_name[ c ] == atom ) return c;
+		}
+		return kkXMLInvalidHandle;
+	}
+	void getNodes( kkXMLHandle h, const kkXMLString& Name, kkArray<kkXMLHandle>& out ) const {
+		out.clear();
+		u32 atom = m_atoms.find( Name );
+		if( atom == kkXMLInvalidHandle ) return;
+		for( kkXMLHandle c = m_firstChild[ h ]; c != kkXMLInvalidHandle; c = m_nextSibling[ c ] ){
+			if( m_name[ c ] == atom ) out.push_back( c );
+		}
+	}
+	// Linear scan over the whole node table, result is in document order.
+	void findAll( const kkXMLString& Name, kkArray<kkXMLHandle>& out ) const {
+		out.clear();
+		u32 atom = m_atoms.find( Name );
+		if( atom == kkXMLInvalidHandle ) return;
+		u32 sz = size();
+		for( u32 i = 0; i < sz; ++i ){
+			if( m_name[ i ] == atom ) out.push_back( i );
+		}
+	}
+};
+
+namespace xmlutil
+{
+	// Bulk variants: one value per node, `defaultValue` where attribute is missing or bad.
+	template<typename T>
+	inline void getAttributesAs( const kkArray<kkXMLNode*>& nodes, const kkXMLString& Name, T defaultValue, kkArray<T>& out ){
+		out.clear();
+		size_t sz = nodes.size();
+		for( size_t i = 0; i < sz; ++i ){
+			out.push_back( nodes[ i ]->getAttributeAs<T>( Name, defaultValue ) );
+		}
+	}
+	template<typename T>
+	inline void getTextsAs( const kkArray<kkXMLNode*>& nodes, T defaultValue, kkArray<T>& out ){
+		out.clear();
+		size_t sz = nodes.size();
+		for( size_t i = 0; i < sz; ++i ){
+			out.push_back( nodes[ i ]->textAs<T>( defaultValue ) );
+		}
+	}
+}
+
+// Items grouped by name atom. Inside of a group the order of build() input,
+// that is document order, is kept.
+template<typename T>
+class kkXMLNameIndex{
+	// items of atom `a` are m_items[ m_begin[ a ] ] ... m_items[ m_begin[ a + 1 ] - 1 ]
+	kkArray<size_t> m_begin;
+	kkArray<T> m_items;
+	kkArray<size_t> m_pos;
+public:
+	// `items[ i ]` is named by `atoms[ i ]`
+	void build( const kkArray<u32>& atoms, const kkArray<T>& items, u32 atomCount ){
+		m_begin.clear();
+		m_begin.resize( atomCount + 1, 0 );
+		size_t sz = items.size();
+		for( size_t i = 0; i < sz; ++i ) ++m_begin[ atoms[ i ] + 1 ];
+		for( u32 a = 0; a < atomCount; ++a ) m_begin[ a + 1 ] += m_begin[ a ];
+		// counting sort
+		m_pos = m_begin;
+		m_items.resize( sz );
+		for( size_t i = 0; i < sz; ++i ) m_items[ m_pos[ atoms[ i ] ]++ ] = items[ i ];
+	}
+	size_t count( u32 atom ) const {
+		return atom + 1 < m_begin.size() ? m_begin[ atom + 1 ] - m_begin[ atom ] : 0;
+	}
+	const T* items( u32 atom ) const { return m_items.data() + m_begin[ atom ]; }
+	void clear(){
+		m_begin.clear();
+		m_items.clear();
+	}
+};
+
+// Immutable, query only snapshot of a document, see kkXMLDocumentT::Freeze.
+// All methods are const and keep scratch data per thread, so one frozen
+// document can be queried from any number of threads without locks.
+class kkXMLFrozenDocument{
+	kkXMLCompactTree m_tree;
+	kkXMLNameIndex<kkXMLHandle> m_byName;
+
+	struct _scratch{
+		std::vector<kkXPathToken> tokens;
+		kkArray<kkXPathToken*> elements;
+		kkArray<u32> atoms;
+		kkXMLString part;
+		kkArray<kkXMLHandle> sorted;
+	};
+	static _scratch& scratch(){
+		static thread_local _scratch s;
+		return s;
+	}
+	bool matchStep( kkXMLHandle h, const kkXPathToken& step, u32 atom ) const {
+		if( m_tree.getNameAtom( h ) != atom ) return false;
+		if( !step.m_predicate ) return true;
+		std::u16string_view value;
+		return m_tree.getAttribute( h, step.m_attribute, value ) && value == std::u16string_view( step.m_value );
+	}
+	// `h` is matched by step `last`, checks that its ancestors match the steps before.
+	bool matchAncestors( kkXMLHandle h, const kkArray<kkXPathToken*>& steps, const kkArray<u32>& atoms, u32 last ) const {
+		kkXMLHandle p = m_tree.getParent( h );
+		if( steps[ last ]->m_axis == kkXPathAxis::Descendant ){
+			if( !last ) return true;
+			for( ; p != kkXMLInvalidHandle; p = m_tree.getParent( p ) ){
+				if( matchStep( p, *steps[ last - 1 ], atoms[ last - 1 ] ) && matchAncestors( p, steps, atoms, last - 1 ) )
+					return true;
+			}
+			return false;
+		}
+		if( !last ) return p == kkXMLInvalidHandle;
+		return p != kkXMLInvalidHandle && matchStep( p, *steps[ last - 1 ], atoms[ last - 1 ] )
+			&& matchAncestors( p, steps, atoms, last - 1 );
+	}
+public:
+	kkXMLFrozenDocument(){}
+	kkXMLFrozenDocument( const kkXMLNode* root ){ build( root ); }
+
+	// False if the tree is over limits of kkXMLCompactTree, then it is empty.
+	bool build( const kkXMLNode* root ){
+		bool ok = m_tree.build( root );
+		u32 sz = m_tree.size();
+		kkArray<u32> atoms;
+		kkArray<kkXMLHandle> handles;
+		atoms.resize( sz );
+		handles.resize( sz );
+		for( u32 i = 0; i < sz; ++i ){
+			atoms[ i ] = m_tree.getNameAtom( i );
+			handles[ i ] = i;
+		}
+		m_byName.build( atoms, handles, m_tree.getAtoms().size() );
+		return ok;
+	}
+	const kkXMLCompactTree& GetTree() const { return m_tree; }
+	// All elements with this name, in document order.
+	void FindAll( const kkXMLString& Name, kkArray<kkXMLHandle>& out ) const {
+		out.clear();
+		u32 atom = m_tree.getAtoms().find( Name );
+		if( atom == kkXMLInvalidHandle ) return;
+		const kkXMLHandle* items = m_byName.items( atom );
+		size_t sz = m_byName.count( atom );
+		for( size_t i = 0; i < sz; ++i ) out.push_back( items[ i ] );
+	}
+	// Same paths as kkXMLDocumentT::SelectNodes. Candidates come from the
+	// name index of the last step and are checked by walking up parents.
+	// Bad expression sets `error` if given.
+	bool SelectNodes( const kkXMLString& XPath_expression, kkArray<kkXMLHandle>& out, kkXMLError* error = nullptr ) const {
+		out.clear();
+		if( xmlutil::XPathFindUnion( XPath_expression, 0 ) == XPath_expression.size() )
+			return selectPath( XPath_expression, out, error );
+		// handles are numbered in document order
+		_scratch& s = scratch();
+		size_t pos = 0;
+		while( xmlutil::XPathNextUnionPart( XPath_expression, pos, s.part ) ){
+			if( !s.part.size() ) return xmlutil::XPathError( error, XPath_expression, u"path", pos - 1 );
+			if( !selectPath( s.part, out, error ) ) return false;
+		}
+		xmlutil::sortUnique( out, s.sorted, []( kkXMLHandle h ){ return h; } );
+		return true;
+	}
+private:
+	// Appends nodes of one path to `out`.
+	bool selectPath( const kkXMLString& XPath_expression, kkArray<kkXMLHandle>& out, kkXMLError* error ) const {
+		_scratch& s = scratch();
+		if( !xmlutil::XPathGetPath( XPath_expression, s.tokens, s.elements, error ) )
+			return false;
+		u32 depth = (u32)s.elements.size();
+		if( !depth || !m_tree.size() ) return true;
+		s.atoms.clear();
+		for( u32 i = 0; i < depth; ++i ){
+			u32 atom = m_tree.getAtoms().find( s.elements[ i ]->m_string );
+			if( atom == kkXMLInvalidHandle ) return true;
+			s.atoms.push_back( atom );
+		}
+		u32 last = depth - 1;
+		const kkXMLHandle* items = m_byName.items( s.atoms[ last ] );
+		size_t sz = m_byName.count( s.atoms[ last ] );
+		const kkXPathToken& step = *s.elements[ last ];
+		for( size_t i = 0; i < sz; ++i ){
+			if( matchStep( items[ i ], step, s.atoms[ last ] ) && matchAncestors( items[ i ], s.elements, s.atoms, last ) )
+				out.push_back( items[ i ] );
+		}
+		return true;
+	}
+};
+
+// Compile time binding of a struct to XML, for kkXMLDocumentT::ParseRecords,
+// ReadRecords and WriteRecords. Fields are described by a specialization:
+//	struct Item{ int id; kkXMLString name; kkArray<double> prices; };
+//	template<> struct kkXMLBinding<Item>{
+//		static constexpr const char16_t* name = u"Item";
+//		static constexpr auto fields = std::make_tuple(
+//			kkXMLAttributeField( u"id", &Item::id ),
+//			kkXMLElementField( u"Name", &Item::name ),
+//			kkXMLElementField( u"Price", &Item::prices ) );
+//	};
+// Field types: numbers and bool, kkXMLString, structs with their own
+// binding, and kkArray of these for repeated elements.
+template<typename T>
+struct kkXMLBinding{};
+enum class kkXMLFieldKind : unsigned int{
+	Attribute,
+	Element,
+	Text		// text of the record element itself
+};
+template<kkXMLFieldKind Kind, typename S, typename M>
+struct kkXMLField{
+	static constexpr kkXMLFieldKind kind = Kind;
+	const char16_t* name;
+	M S::* member;
+};
+template<typename S, typename M>
+constexpr kkXMLField<kkXMLFieldKind::Attribute, S, M> kkXMLAttributeField( const char16_t* name, M S::* member ){ return { name, member }; }
+template<typename S, typename M>
+constexpr kkXMLField<kkXMLFieldKind::Element, S, M> kkXMLElementField( const char16_t* name, M S::* member ){ return { name, member }; }
+template<typename S, typename M>
+constexpr kkXMLField<kkXMLFieldKind::Text, S, M> kkXMLTextField( M S::* member ){ return { u"", member }; }
+
+namespace xmlutil
+{
+	template<typename T, typename = void>
+	struct hasBinding : std::false_type{};
+	template<typename T>
+	struct hasBinding<T, std::void_t<decltype( kkXMLBinding<T>::fields )>> : std::true_type{};
+	template<typename T>
+	struct isBindArray : std::false_type{};
+	template<typename T>
+	struct isBindArray<kkArray<T>> : std::true_type{};
+
+	template<typename T, typename F>
+	inline void forEachField( F&& f ){
+		std::apply( [&]( const auto&... field ){ ( f( field ), ... ); }, kkXMLBinding<T>::fields );
+	}
+	inline void bindText( const kkXMLString& text, kkXMLString& value ){ value = text; }
+	template<typename M>
+	inline typename std::enable_if<std::is_arithmetic<M>::value>::type
+	bindText( const kkXMLString& text, M& value ){ parseValue( text, value ); }
+
+	inline void formatValue( kkXMLString& out, bool value ){ out += value ? u"true" : u"false"; }
+	template<typename M>
+	inline typename std::enable_if<std::is_arithmetic<M>::value>::type
+	formatValue( kkXMLString& out, M value ){
+		// shortest text that is read back to the same value
+		char buf[ 64 ];
+		std::to_chars_result r = std::to_chars( buf, buf + sizeof(buf), value );
+		for( char* c = buf; c < r.ptr; ++c ) out += (char16_t)*c;
+	}
+}
+
+// Mapping for kkXMLDocumentT::TranscodeJSON. Element with text only is
+// a string, empty element is null, others are objects: attributes are
+// keys with `attributePrefix`, text is under `textKey`, children are keys
+// by their names.
+struct kkXMLJSONOptions{
+	kkXMLString attributePrefix = u"@";
+	kkXMLString textKey = u"#text";
+	// Children with the same name next to each other are one array, the
+	// same name after other elements starts another key. Without it every
+	// child is its own key.
+	bool arrays = true;
+	// JSON of first child of a run is held until its next sibling shows if
+	// it is an array. Past this many bytes it is written as single value and
+	// rest of the run are repeated keys.
+	size_t holdSize = 1u << 22;
+};
+
+namespace xmlutil
+{
+	// UTF-8 JSON text into buffer, buffer goes to `sink( data, size )` when full.
+	// Output from position given to `keep` on is not given to sink, so it
+	// can still be changed by `insert`. Positions count from start of output.
+	template<typename F>
+	class JSONWriter{
+		F& m_sink;
+		kkXMLStringA m_buffer;
+		size_t m_flushed = 0;
+		size_t m_keep = npos;
+		static constexpr size_t bufferSize = 1u << 16;
+	public:
+		static constexpr size_t npos = (size_t)-1;
+		JSONWriter( F& sink ):m_sink( sink ){ m_buffer.reserve( bufferSize + 16 ); }
+		void put( char c ){
+			m_buffer += c;
+			if( m_buffer.size() >= bufferSize ) flush();
+		}
+		void put( const char* str ){
+			m_buffer += str;
+			if( m_buffer.size() >= bufferSize ) flush();
+		}
+		void flush(){
+			size_t n = m_keep == npos ? m_buffer.size() : m_keep - m_flushed;
+			if( n ){
+				m_sink( m_buffer.data(), n );
+				m_buffer.erase( 0, n );
+				m_flushed += n;
+			}
+		}
+		size_t position() const { return m_flushed + m_buffer.size(); }
+		// npos lets everything go
+		void keep( size_t pos ){ m_keep = pos; }
+		size_t keepPosition() const { return m_keep; }
+		size_t kept() const { return m_keep == npos ? 0 : position() - m_keep; }
+		void insert( size_t pos, char c ){ m_buffer.insert( m_buffer.begin() + (pos - m_flushed), c ); }
+		// Quoted and escaped, without quotes when `quote` is false.
+		void string( const kkXMLString& str, bool quote = true ){
+			static const char hex[] = "0123456789abcdef";
+			if( quote ) m_buffer += '\"';
+			size_t sz = str.size();
+			for( size_t i = 0; i < sz; ++i ){
+				char16_t c = str[ i ];
+				if( c < 0x80 ){
+					if( c == u'\"' || c == u'\\' ){
+						m_buffer += '\\';
+						m_buffer += (char)c;
+					}else if( c < 0x20 ){
+						if( c == u'\n' ) m_buffer += "\\n";
+						else if( c == u'\r' ) m_buffer += "\\r";
+						else if( c == u'\t' ) m_buffer += "\\t";
+						else{
+							m_buffer += "\\u00";
+							m_buffer += hex[ c >> 4 ];
+							m_buffer += hex[ c & 0xF ];
+						}
+					}else m_buffer += (char)c;
+				}else if( c < 0x800 ){
+					m_buffer += (char)((c>>6)|0xc0);
+					m_buffer += (char)((c&0x3f)|0x80);
+				}else if( c >= 0xD800 && c < 0xDC00 && i + 1u < sz
+					&& str[ i + 1u ] >= 0xDC00 && str[ i + 1u ] < 0xE000 ){
+					unsigned int uni = 0x10000 + (((unsigned int)c - 0xD800) << 10) + (str[ ++i ] - 0xDC00);
+					m_buffer += (char)((uni>>18)|0xf0);
+					m_buffer += (char)(((uni>>12)&0x3f)|0x80);
+					m_buffer += (char)(((uni>>6)&0x3f)|0x80);
+					m_buffer += (char)((uni&0x3f)|0x80);
+				}else{
+					m_buffer += (char)((c>>12)|0xe0);
+					m_buffer += (char)(((c>>6)&0x3f)|0x80);
+					m_buffer += (char)((c&0x3f)|0x80);
+				}
+				if( m_buffer.size() >= bufferSize ) flush();
+			}
+			if( quote ) m_buffer += '\"';
+		}
+		void key( const kkXMLString& prefix, const kkXMLString& name ){
+			m_buffer += '\"';
+			string( prefix, false );
+			string( name, false );
+			m_buffer += "\":";
+		}
+	};
+}
+
+// Parser policy, compile time. Disabled features are compiled out of the parser.
+//	trimText		- remove spaces around element text
+//	decodeEntities	- replace &lt; &gt; &amp; &apos; &quot;
+//	validate		- check that closing tag matches opening tag
+//	trackPosition	- remember where every element is in source text. Without
+//					  it Write serializes whole tree.
+//	hashNodes		- compute kkXMLNode::hash of every element while parsing,
+//					  otherwise it is computed on first use
+struct kkXMLDefaultPolicy{
+	static constexpr bool trimText = true;
+	static constexpr bool decodeEntities = true;
+	static constexpr bool validate = true;
+	static constexpr bool trackPosition = true;
+	static constexpr bool hashNodes = false;
+};
+// For trusted machine generated input
+struct kkXMLFastPolicy{
+	static constexpr bool trimText = false;
+	static constexpr bool decodeEntities = false;
+	static constexpr bool validate = false;
+	static constexpr bool trackPosition = false;
+	static constexpr bool hashNodes = false;
+};
+
+template<typename Policy>
+class kkXMLDocumentT{
 	bool		m_isInit = false;
 	kkXMLNode	m_root;
 	kkXMLString	m_fileName;
 	kkXMLString	m_text;
+	// Text that is parsed. Points to m_text, or to caller's buffer after
+	// ParseBuffer( const char16_t*, size_t ).
+	const char16_t*	m_source = nullptr;
+	size_t			m_sourceSize = 0;
+	bool			m_ownsSource = false;
 
-	kkXMLString m_expect_apos;
-	kkXMLString m_expect_quot;
-	kkXMLString m_expect_eq;
-	kkXMLString m_expect_slash;
-	kkXMLString m_expect_lt;
-	kkXMLString m_expect_gt;
-	kkXMLString m_expect_sub;
-	kkXMLString m_expect_ex;
-	void _initExpectStrings()
-	{
-		m_expect_apos = u"\'";
-		m_expect_quot = u"\"";
-		m_expect_eq   = u"=";
-		m_expect_slash= u"/";
-		m_expect_lt   = u"<";
-		m_expect_gt   = u">";
-		m_expect_sub  = u"-";
-		m_expect_ex   = u"!";
-	}
+	const kkXMLString m_expect_apos = u"\'";
+	const kkXMLString m_expect_quot = u"\"";
+	const kkXMLString m_expect_eq   = u"=";
+	const kkXMLString m_expect_slash= u"/";
+	const kkXMLString m_expect_lt   = u"<";
+	const kkXMLString m_expect_gt   = u">";
+	const kkXMLString m_expect_sub  = u"-";
+	const kkXMLString m_expect_ex   = u"!";
 
-	unsigned int m_cursor = 0;
-	unsigned int m_sz = 0;
+	size_t m_cursor = 0;
+	size_t m_sz = 0;
 
 	enum _token_type{
-		tt_default,
-		tt_string
+		tt_default, // name
+		tt_symbol,  // one of m_expect_*
+		tt_string,  // attribute value
+		tt_text     // element text
 	};
 	struct _token{
-		_token( kkXMLString N, unsigned int R, unsigned int C, _token_type t = _token_type::tt_default ):
-			name( N ), line( R ), col( C ), type( t ){}
 		kkXMLString name;
-		unsigned int line;
-		unsigned int col;
-		_token_type type;
+		size_t offset = 0; // position in source text
+		_token_type type = _token_type::tt_default;
 	};
 
+	// Tokens are never freed between parses, only m_tokenCount is reset,
+	// so their strings keep capacity.
 	kkArray<_token> m_tokens;
+	size_t m_tokenCount = 0;
+	kkXMLString m_str;
+	kkXMLStringA m_bytes; // raw file contents
+
+	// Nodes and attributes of previous parses, ready for reuse
+	kkArray<kkXMLNode*> m_freeNodes;
+	kkArray<kkXMLAttribute*> m_freeAttributes;
+
+	// Owning pointer that gives the object back to the pool
+	template<typename T>
+	class _pooled{
+		kkXMLDocumentT* m_doc;
+		T* m_ptr;
+	public:
+		_pooled( kkXMLDocumentT* doc, T* p ): m_doc( doc ), m_ptr( p ){}
+		~_pooled(){ if( m_ptr ) m_doc->recycle( m_ptr ); }
+		_pooled& operator=( T* p ){
+			if( m_ptr ) m_doc->recycle( m_ptr );
+			m_ptr = p;
+			return *this;
+		}
+		T* operator->(){ return m_ptr; }
+		T* ptr(){ return m_ptr; }
+		T* release(){ T* p = m_ptr; m_ptr = nullptr; return p; }
+	};
+
+	kkXMLNode* newNode(){
+		kkXMLStatsAdd( m_stats, m_nodes, 1 );
+		if( m_freeNodes.size() ){
+			kkXMLNode* node = m_freeNodes.back();
+			m_freeNodes.pop_back();
+			return node;
+		}
+		kkXMLStatsAdd( m_stats, m_allocations, 1 );
+		return kkCreate(kkXMLNode)();
+	}
+	kkXMLAttribute* newAttribute(){
+		if( m_freeAttributes.size() ){
+			kkXMLAttribute* at = m_freeAttributes.back();
+			m_freeAttributes.pop_back();
+			return at;
+		}
+		kkXMLStatsAdd( m_stats, m_allocations, 1 );
+		return kkCreate(kkXMLAttribute)();
+	}
+	void recycle( kkXMLAttribute* at ){
+		at->name.clear();
+		at->value.clear();
+		m_freeAttributes.push_back( at );
+	}
+	void recycle( kkXMLNode* node ){
+		recycleChildren( node );
+		node->name.clear();
+		node->text.clear();
+		node->parent = nullptr;
+		m_freeNodes.push_back( node );
+	}
+	// Like kkXMLNode::clear, but keeps children in the pool
+	void recycleChildren( kkXMLNode* node ){
+		for( auto * a : node->attributeList ) recycle( a );
+		node->attributeList.clear();
+		for( auto * n : node->nodeList ) recycle( n );
+		node->nodeList.clear();
+		node->resetSource();
+		node->m_dirty = false;
+		node->m_subtreeDirty = false;
+		node->m_hashValid = false;
+	}
+	_token& pushToken( size_t offset, _token_type type = _token_type::tt_default ){
+		if( m_tokenCount == m_tokens.size() ){
+			m_tokens.push_back( _token() );
+			kkXMLStatsAdd( m_stats, m_allocations, 1 );
+		}
+		_token& t = m_tokens[ m_tokenCount++ ];
+		t.name.clear();
+		t.offset = offset;
+		t.type = type;
+		return t;
+	}
+
+	kkXMLParseStats* m_stats = nullptr;
+	unsigned int m_depth = 0;
+	kkXMLError m_error;
+
+	// Scratch storage reused by SelectNodes
+	std::vector<kkXPathToken> m_XPathTokens;
+	kkArray<kkXPathToken*> m_XPathElements;
+
+	// Element name index for `//` steps. Built on first use, built again
+	// after the tree is changed through kkXMLNode methods.
+	bool m_useNameIndex = true;
+	bool m_nameIndexValid = false;
+	unsigned int m_nameIndexVersion = 0;
+	kkXMLAtomTable m_nameAtoms;
+	kkXMLNameIndex<kkXMLNode*> m_nameIndex;
+	kkArray<kkXMLNode*> m_order;
+	kkArray<u32> m_orderAtoms;
+
+	// Attribute value indexes, see AddAttributeIndex. Built on first use
+	// like the name index.
+	struct _attributeIndex{
+		kkXMLString name;
+		kkXMLAtomTable values;
+		kkXMLNameIndex<kkXMLNode*> nodes; // by value atom
+		kkArray<kkXMLNode*> order;
+		kkArray<u32> orderAtoms;
+	};
+	kkArray<_attributeIndex> m_attributeIndexes;
+	bool m_attributeIndexValid = false;
+	unsigned int m_attributeIndexVersion = 0;
+
+	// Pre-order and post-order numbers of nodes, see UpdateOrder
+	size_t m_preCount = 0;
+	size_t m_postCount = 0;
+	bool m_orderValid = false;
+	unsigned int m_orderVersion = 0;
+	kkXMLString m_XPathPart;
+	kkXMLString m_XPathAttribute;
+	kkXMLString m_XPathUnion;
+	kkXMLString m_XPathPartAttribute;
+	kkArray<kkXMLNode*> m_XPathNodes;
+	kkArray<kkXMLNode*> m_sorted;
 	void getTokens(){
-		char16_t * ptr = m_text.data();
-		unsigned int line = 1;
-		unsigned int col = 1;
+		const char16_t * begin = m_source;
+		const char16_t * end = m_source + m_sourceSize;
+		const char16_t * ptr = begin;
 		bool isString = false;
 		bool stringType = false; // "
-		kkXMLString str;
-		unsigned int oldCol = 0;
-		while( *ptr ){
-			if( *ptr == u'\n' ){
-				col = 0;
-				++line;
-			}else{
+		kkXMLString& str = m_str;
+		str.clear();
+		size_t oldOffset = 0;
+		while( ptr < end ){
+			if( *ptr != u'\n' ){
 				if( !isString ){
 					if( charIsSymbol( ptr ) ){
-						kkXMLString tmp; tmp += *ptr;
-						m_tokens.push_back( _token( tmp, line, col ) );
+						pushToken( (size_t)(ptr - begin), _token_type::tt_symbol ).name += *ptr;
 						if( *ptr == u'\'' ){
-							oldCol = col;
+							oldOffset = (size_t)(ptr - begin) + 1;
 							str.clear();
 							isString = true;
 							stringType = true;
 						}else if( *ptr == u'\"' ){
-							oldCol = col;
+							oldOffset = (size_t)(ptr - begin) + 1;
 							isString = true;
 							stringType = false;
 							str.clear();
 						}else if( *ptr == u'>' ){
 							++ptr;
-							++col;
-							ptr = skipSpace( ptr, line, col );
-							oldCol = col;
-							ptr = getString( ptr, str, line, col );
-							if( str.size() )
+							ptr = skipSpace( ptr );
+							oldOffset = (size_t)(ptr - begin);
+							_token& text = pushToken( oldOffset, _token_type::tt_text );
+							ptr = getString( ptr, text.name );
+							if( text.name.size() )
 							{
-								xmlutil::stringTrimSpace( str );
-								decodeEnts( str );
-								m_tokens.push_back( _token( str, line, oldCol ) );
-								str.clear();
+								if constexpr( Policy::trimText )
+									xmlutil::stringTrimSpace( text.name );
+								decodeEnts( text.name );
 							}
+							else --m_tokenCount;
 							continue;
 						}
 					}
-					else if( charForName( ptr ) ){
-						oldCol = col;
-						kkXMLString name;
-						ptr = getName( ptr, name, line, col );
-						m_tokens.push_back( _token( name, line, oldCol ) );
+					else if( charForNameStart( ptr ) ){
+						oldOffset = (size_t)(ptr - begin);
+						ptr = getName( ptr, pushToken( oldOffset ).name );
 						continue;
 					}
 				}else{
 					if( stringType ){ // '
 						if( *ptr == u'\'' ){
 							decodeEnts( str );
-							m_tokens.push_back( _token( str, line, oldCol+1, kkXMLDocument::_token_type::tt_string ) );
-							kkXMLString tmp; tmp += *ptr;
-							m_tokens.push_back( _token( tmp, line, col ) );
+							pushToken( oldOffset, _token_type::tt_string ).name = str;
+							pushToken( (size_t)(ptr - begin), _token_type::tt_symbol ).name += *ptr;
 							str.clear();
 							isString = false;
 							goto chponk;
@@ -764,9 +3262,8 @@ class kkXMLDocument{
 					else{ // "
 						if( *ptr == u'\"' ){
 							decodeEnts( str );
-							m_tokens.push_back( _token( str, line, oldCol+1, kkXMLDocument::_token_type::tt_string ) );
-							kkXMLString tmp; tmp += *ptr;
-							m_tokens.push_back( _token( tmp, line, col ) );
+							pushToken( oldOffset, _token_type::tt_string ).name = str;
+							pushToken( (size_t)(ptr - begin), _token_type::tt_symbol ).name += *ptr;
 							str.clear();
 							isString = false;
 							goto chponk;
@@ -776,101 +3273,105 @@ class kkXMLDocument{
 				}
 			}
 	chponk:
-			++col;
 			++ptr;
 		}
 	}
 	void decodeEnts( kkXMLString& str ){
-		xmlutil::stringReplaseSubString( str, kkXMLString(u"&apos;"), kkXMLString(u"\'") );
-		xmlutil::stringReplaseSubString( str, kkXMLString(u"&quot;"), kkXMLString(u"\"") );
-		xmlutil::stringReplaseSubString( str, kkXMLString(u"&lt;"), kkXMLString(u"<") );
-		xmlutil::stringReplaseSubString( str, kkXMLString(u"&kk;"), kkXMLString(u">") );
-		xmlutil::stringReplaseSubString( str, kkXMLString(u"&amp;"), kkXMLString(u"&") );
+		if constexpr( !Policy::decodeEntities ) return;
+		{
+			size_t sz = str.size();
+			size_t i = 0;
+			while( i < sz && str[ i ] != u'&' ) ++i;
+			if( i == sz ) return;
+		}
+		kkXMLStatsTime( m_stats, kkXMLParsePhase::DecodeEntities );
+		// single pass, in place: output is never longer than input
+		static const struct{ std::u16string_view ent; char16_t c; } ents[] = {
+			{ u"&apos;", u'\'' },
+			{ u"&quot;", u'\"' },
+			{ u"&lt;",   u'<' },
+			{ u"&gt;",   u'>' },
+			{ u"&amp;",  u'&' },
+		};
+		size_t count = 0;
+		size_t sz = str.size();
+		size_t out = 0;
+		for( size_t i = 0; i < sz; ){
+			if( str[ i ] == u'&' ){
+				std::u16string_view rest( str.data() + i, sz - i );
+				bool found = false;
+				for( auto & e : ents ){
+					if( rest.substr( 0, e.ent.size() ) == e.ent ){
+						str[ out++ ] = e.c;
+						i += e.ent.size();
+						++count;
+						found = true;
+						break;
+					}
+				}
+				if( found ) continue;
+			}
+			str[ out++ ] = str[ i++ ];
+		}
+		str.resize( out );
+		kkXMLStatsAdd( m_stats, m_entities, count );
+		(void)count;
 	}
-	char16_t * getName( char16_t * ptr, kkXMLString& outText, unsigned int& line, unsigned int& col ){
-		while( *ptr ){
+	const char16_t * getName( const char16_t * ptr, kkXMLString& outText ){
+		const char16_t * end = m_source + m_sourceSize;
+		while( ptr < end ){
 			if( charForName( ptr ) ) outText += *ptr;
 			else return ptr; 
 			++ptr;
-			++col;
 		}
 		return ptr;
 	}
-	char16_t * getString( char16_t * ptr, kkXMLString& outText, unsigned int& line, unsigned int& col ){
-		while( *ptr ){
-			if( *ptr == u'\n' ){
-				++line;
-				col = 1;
-				outText += *ptr;
-				++ptr;
-			}else if( *ptr == u'<' )
+	const char16_t * getString( const char16_t * ptr, kkXMLString& outText ){
+		const char16_t * end = m_source + m_sourceSize;
+		while( ptr < end ){
+			if( *ptr == u'<' )
 				break;
-			else{
-				outText += *ptr;
-				++col;
-				++ptr;
-			}
+			outText += *ptr;
+			++ptr;
 		}
 		return ptr;
 	}
 
-	char16_t * skipSpace( char16_t * ptr, unsigned int& line, unsigned int& col ){
-		while( *ptr ){
-			if( *ptr == u'\n' ){
-				++line;
-				col = 1;
-				++ptr;
-			}else if( (*ptr == u'\r')
+	const char16_t * skipSpace( const char16_t * ptr ){
+		const char16_t * end = m_source + m_sourceSize;
+		while( ptr < end ){
+			if( (*ptr == u'\n')
+				|| (*ptr == u'\r')
 				|| (*ptr == u'\t')
 				|| (*ptr == u' ')){
-				++col;
 				++ptr;
 			}else break;
 		}
 		return ptr;
 	}
 
-	bool charForName( char16_t * ptr ){
-		char16_t c = *ptr;
-		if( c > 0x80 ) return true;
-		if( xmlutil::isAlpha( *ptr ) 
-				|| xmlutil::isDigit( *ptr )
-				|| (*ptr == u'_')
-				|| (*ptr == u'.')){
-			return true;
-		}
-		return false;
+	bool charForNameStart( const char16_t * ptr ){
+		return xmlutil::isNameStartChar( *ptr );
 	}
-	bool charForString( char16_t * ptr ){
-		char16_t c = *ptr;
-		if( c > 0x80 ) return true;
-		if( xmlutil::isAlpha( *ptr ) 
-				|| xmlutil::isDigit( *ptr )
-				|| (*ptr == u'_')
-				|| (*ptr == u'.')){
-			return true;
-		}
-		return false;
+	bool charForName( const char16_t * ptr ){
+		return xmlutil::isNameChar( *ptr );
 	}
-	bool charIsSymbol( char16_t * ptr ){
-		char16_t c = *ptr;
-		if( (c == u'<') || (c == u'>')
-			|| (c == u'/') || (c == u'\'')
-			|| (c == u'\"') || (c == u'=')
-			|| (c == u'?') || (c == u'!')
-			|| (c == u'-') ){
-			return true;
-		}
-		return false;
+	bool charIsSymbol( const char16_t * ptr ){
+		return xmlutil::charIs( *ptr, xmlutil::cc_symbol );
 	}
 	bool analyzeTokens(){
-		unsigned int sz = (unsigned int)m_tokens.size();
-		if( !sz ){
-			fprintf( stderr, "Empty XML\n" );
+		if( !m_tokenCount ){
+			m_error.code = kkXMLErrorCode::Empty;
 			return false;
 		}
+		skipProlog();
+		return buildXMLDocument();
+	}
+	// Moves m_cursor to root element.
+	void skipProlog(){
+		size_t sz = m_tokenCount;
 		m_cursor = 0;
-		if( m_tokens[ 0 ].name == u"<" ){
+		if( sz > 2 && m_tokens[ 0 ].name == m_expect_lt ){
 			if( m_tokens[ 1 ].name == u"?" ){
 				if( m_tokens[ 2 ].name == u"xml" ){
 					m_cursor = 2;
@@ -878,114 +3379,127 @@ class kkXMLDocument{
 				}
 			}
 		}
-		if( m_tokens[ m_cursor ].name == u"<" ){
-			if( m_tokens[ m_cursor + 1 ].name == u"!" ){
+		if( m_cursor + 2 < sz && tokenIs( m_expect_lt ) ){
+			if( m_tokens[ m_cursor + 1 ].name == m_expect_ex ){
 				if( m_tokens[ m_cursor + 2 ].name == u"DOCTYPE" ) skipPrologAndDTD();
 			}
 		}
-		return buildXMLDocument();
 	}
 
 	bool buildXMLDocument(){
-		m_sz = (unsigned int)m_tokens.size();
-		return getSubNode( &m_root);
+		m_sz = m_tokenCount;
+		m_preCount = m_postCount = 0;
+		if( !getSubNode( &m_root) ) return false;
+		m_root.m_post = m_postCount++;
+		m_orderValid = true;
+		m_orderVersion = m_root.m_version;
+		return true;
+	}
+	void numberNodes( kkXMLNode* node ){
+		node->m_pre = m_preCount++;
+		size_t sz = node->nodeList.size();
+		for( size_t i = 0; i < sz; ++i ) numberNodes( node->nodeList[ i ] );
+		node->m_post = m_postCount++;
 	}
 	bool getSubNode( kkXMLNode * node ){	
-		//kkPtr<kkXMLNode> subNode = kkCreate<kkXMLNode>();
-		kkPtr<kkXMLNode> subNode = kkCreate(kkXMLNode)();
-		kkXMLString name;
+		node->m_pre = m_preCount++;
+		_pooled<kkXMLNode> subNode( this, newNode() );
+		kkXMLStatsMax( m_stats, m_maxDepth, m_depth );
+		const kkXMLString& name = node->name;
 		bool next = false;
 		while( m_cursor < m_sz ){
-			if( m_tokens[ m_cursor ].name == m_expect_lt ){
+			if( tokenIs( m_expect_lt ) ){
+				if constexpr( Policy::trackPosition )
+					node->m_sourceBegin = m_tokens[ m_cursor ].offset;
 				if( nextToken() ) return false;
 				if( tokenIsName() ){
-					name = m_tokens[ m_cursor ].name;
-					node->name = name;
+					node->name = m_tokens[ m_cursor ].name;
 					if( nextToken() ) return false;
 					// First - attributes
 					if( tokenIsName() ){
 						--m_cursor;
 						if( !getAttributes( node ) ) return false;
 					}
-					if( m_tokens[ m_cursor ].name == m_expect_gt ){
+					if( tokenIs( m_expect_gt ) ){
 						if( nextToken() ) return false;
-						if( tokenIsName() ){
+						if( tokenIsText() ){
 							node->text = m_tokens[ m_cursor ].name;
 							if( nextToken() ) return false;
 	closeNode:
-							if( m_tokens[ m_cursor ].name == m_expect_lt ){
+							if( tokenIs( m_expect_lt ) ){
 								if( nextToken() ) return false;
-								if( m_tokens[ m_cursor ].name == m_expect_slash ){
+								if( tokenIs( m_expect_slash ) ){
 									if( nextToken() ) return false;
-									if( m_tokens[ m_cursor ].name == name ){
+									if( closeNameMatches( name ) ){
 										if( nextToken() ) return false;
-										if( m_tokens[ m_cursor ].name == m_expect_gt ){
-											++m_cursor;
-											return true;
+										if( tokenIs( m_expect_gt ) ){
+											return endNode( node );
 										}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_gt );
 									}else return unexpectedToken( m_tokens[ m_cursor ], name );
 								}else if( tokenIsName() ){
 									--m_cursor;
-									subNode = kkCreate(kkXMLNode)();
+									subNode = newNode();
 									goto newNode;
 								}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_slash );
 							}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_lt );
-						}else if( m_tokens[ m_cursor ].name == m_expect_lt ){ // next or </
+						}else if( tokenIs( m_expect_lt ) ){ // next or </
 							if( nextToken() ) return false;
 							if( tokenIsName() ){ // next node
 								next = true;
 								--m_cursor;
-							}else if( m_tokens[ m_cursor ].name == m_expect_slash ){ // return true
+							}else if( tokenIs( m_expect_slash ) ){ // return true
 								if( nextToken() )return false;
-								if( m_tokens[ m_cursor ].name == name ){
+								if( closeNameMatches( name ) ){
 									if( nextToken() ) return false;
-									if( m_tokens[ m_cursor ].name == m_expect_gt ){
-										++m_cursor;
-										return true;
+									if( tokenIs( m_expect_gt ) ){
+										return endNode( node );
 									}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_gt );
 								}else return unexpectedToken( m_tokens[ m_cursor ], name );
 							}else return unexpectedToken( m_tokens[ m_cursor ], u"/ or <entity>" );
 						}else return unexpectedToken( m_tokens[ m_cursor ], u"\"text\" or <entity>" );
-					}else if( m_tokens[ m_cursor ].name == m_expect_slash ){
+					}else if( tokenIs( m_expect_slash ) ){
 						if( nextToken() )  return false;
-						if( m_tokens[ m_cursor ].name == m_expect_gt ){
-							++m_cursor;
-							return true;
+						if( tokenIs( m_expect_gt ) ){
+							return endNode( node );
 						}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_gt );
 					}else return unexpectedToken( m_tokens[ m_cursor ], u"> or /" );
 				}else return unexpectedToken( m_tokens[ m_cursor ], u"name" );
 			}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_lt );
 			if( next ){
 	newNode:
-				if( getSubNode( subNode.ptr() ) ){
+				++m_depth;
+				bool ok = getSubNode( subNode.ptr() );
+				--m_depth;
+				if( ok ){
 	///				subNode->addRef();
-					node->addNode( subNode.ptr() );
-					subNode = nullptr; /// âìåñòî subNode->addRef();
+					subNode->m_post = m_postCount++;
+					subNode->parent = node;
+					node->nodeList.push_back( subNode.release() );
 					--m_cursor;
 					if( nextToken() ) return false;
-					if( m_tokens[ m_cursor ].name == m_expect_lt ){
+					if( tokenIs( m_expect_lt ) ){
 						if( nextToken() ) return false;
-						if( m_tokens[ m_cursor ].name == m_expect_slash ){
+						if( tokenIs( m_expect_slash ) ){
 							--m_cursor;
 							goto closeNode;
 						}else if( tokenIsName() ){
 							--m_cursor;
-							subNode = kkCreate(kkXMLNode)();
+							subNode = newNode();
 							goto newNode;
 						}else return unexpectedToken( m_tokens[ m_cursor ], u"</close tag> or <new tag>" );
-					}else if( tokenIsName() ){
+					}else if( tokenIsText() ){
 						node->text = m_tokens[ m_cursor ].name;
 						if( nextToken() ) return false;
-						if( m_tokens[ m_cursor ].name == m_expect_lt ){
+						if( tokenIs( m_expect_lt ) ){
 							if( nextToken() )  return false;
-							if( m_tokens[ m_cursor ].name == m_expect_slash ){
+							if( tokenIs( m_expect_slash ) ){
 								--m_cursor;
 								goto closeNode;
 							}
 							else if( tokenIsName() ){
 								--m_cursor;
 								//subNode.clear();
-								subNode = kkCreate(kkXMLNode)();
+								subNode = newNode();
 								goto newNode;
 							}else return unexpectedToken( m_tokens[ m_cursor ], u"</close tag> or <new tag>" );
 						}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_lt );
@@ -995,78 +3509,597 @@ class kkXMLDocument{
 		}
 		return true;
 	}
+	bool closeNameMatches( const kkXMLString& name ){
+		if constexpr( Policy::validate )
+			return m_tokens[ m_cursor ].name == name;
+		else
+			return true;
+	}
+	bool endNode( kkXMLNode * node ){
+		if constexpr( Policy::trackPosition )
+			node->m_sourceEnd = m_tokens[ m_cursor ].offset + 1;
+		if constexpr( Policy::hashNodes )
+			node->updateHash();
+		++m_cursor;
+		return true;
+	}
 	bool getAttributes( kkXMLNode * node ){
 		for(;;){
-			kkPtr<kkXMLAttribute> at = kkCreate(kkXMLAttribute)();
+			_pooled<kkXMLAttribute> at( this, newAttribute() );
 			if( nextToken() ) return false;
 			if( tokenIsName() ){
 				at->name = m_tokens[ m_cursor ].name;
 				if( nextToken() )  return false;
-				if( m_tokens[ m_cursor ].name == m_expect_eq ){
+				if( tokenIs( m_expect_eq ) ){
 					if( nextToken() )  return false;
-					if( m_tokens[ m_cursor ].name == m_expect_apos ) {
+					if( tokenIs( m_expect_apos ) ) {
 						if( nextToken() )  return false;
 						//if( tokenIsName() ){
 						if( tokenIsString() ){
 							at->value = m_tokens[ m_cursor ].name;
 							if( nextToken() ) return false;
-							if( m_tokens[ m_cursor ].name == m_expect_apos ){
+							if( tokenIs( m_expect_apos ) ){
 	///							at->addRef();
-								node->addAttribute( at.ptr() );
-								at = nullptr; /// âìåñòî at->addRef();
+								node->attributeList.push_back( at.release() );
+								kkXMLStatsAdd( m_stats, m_attributes, 1 );
 								continue;
 							}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_apos );
 						}
-					}else if( m_tokens[ m_cursor ].name == m_expect_quot ){
+					}else if( tokenIs( m_expect_quot ) ){
 						if( nextToken() )  return false;
 						//if( tokenIsName() ){ //is string
 						if( tokenIsString() ){
 							at->value = m_tokens[ m_cursor ].name;
 							if( nextToken() ) return false;
-							if( m_tokens[ m_cursor ].name == m_expect_quot ){
+							if( tokenIs( m_expect_quot ) ){
 	///							at->addRef();
-								node->addAttribute( at.ptr() );
-								at = nullptr; /// âìåñòî at->addRef();
+								node->attributeList.push_back( at.release() );
+								kkXMLStatsAdd( m_stats, m_attributes, 1 );
 								continue;
 							}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_quot );
 						}
 					}else return unexpectedToken( m_tokens[ m_cursor ], u"\' or \"" );
 				}else return unexpectedToken( m_tokens[ m_cursor ], m_expect_eq );
-			} else if( m_tokens[ m_cursor ].name == m_expect_gt || m_tokens[ m_cursor ].name == m_expect_slash )
+			} else if( tokenIs( m_expect_gt ) || tokenIs( m_expect_slash ) )
 				return true;
 			else
 				return unexpectedToken( m_tokens[ m_cursor ], u"attribute or / or >" );
 		} 
 		return false;
 	}
-	bool tokenIsName(){
-		if( m_tokens[ m_cursor ].name == m_expect_lt ) return false;
-		if( m_tokens[ m_cursor ].name == m_expect_gt ) return false;
-		if( m_tokens[ m_cursor ].name == m_expect_sub ) return false;
-		if( m_tokens[ m_cursor ].name == m_expect_ex ) return false;
-		if( m_tokens[ m_cursor ].name == m_expect_eq ) return false;
-		if( m_tokens[ m_cursor ].name == m_expect_apos ) return false;
-		if( m_tokens[ m_cursor ].name == m_expect_quot ) return false;
-		if( m_tokens[ m_cursor ].name == m_expect_slash ) return false;
+	// Binding reader. Works on tokens, no nodes are made. Each function
+	// starts at `<` of element and moves m_cursor after its end.
+	bool endOfTokens(){
+		if( m_cursor < m_sz ) return false;
+		m_error.code = kkXMLErrorCode::UnexpectedEnd;
+		m_error.offset = m_sourceSize;
 		return true;
 	}
+	// Calls attribute( name, value ), text( text ) and child( name ); child
+	// must read or skip the child element.
+	template<typename A, typename X, typename C>
+	bool bindElement( A&& attribute, X&& text, C&& child ){
+		if( !tokenIs( m_expect_lt ) ) return unexpectedToken( m_tokens[ m_cursor ], m_expect_lt );
+		if( nextToken() ) return false;
+		if( !tokenIsName() ) return unexpectedToken( m_tokens[ m_cursor ], u"name" );
+		const kkXMLString& name = m_tokens[ m_cursor ].name;
+		if( nextToken() ) return false;
+		while( tokenIsName() ){
+			const kkXMLString& attributeName = m_tokens[ m_cursor ].name;
+			if( nextToken() ) return false;
+			if( !tokenIs( m_expect_eq ) ) return unexpectedToken( m_tokens[ m_cursor ], m_expect_eq );
+			if( nextToken() ) return false;
+			const kkXMLString& quote = m_tokens[ m_cursor ].name;
+			if( !tokenIs( m_expect_apos ) && !tokenIs( m_expect_quot ) ) return unexpectedToken( m_tokens[ m_cursor ], u"\' or \"" );
+			if( nextToken() ) return false;
+			if( !tokenIsString() ) return unexpectedToken( m_tokens[ m_cursor ], quote );
+			attribute( attributeName, m_tokens[ m_cursor ].name );
+			if( nextToken() ) return false;
+			if( !tokenIs( quote ) ) return unexpectedToken( m_tokens[ m_cursor ], quote );
+			if( nextToken() ) return false;
+		}
+		if( tokenIs( m_expect_slash ) ){
+			if( nextToken() ) return false;
+			if( !tokenIs( m_expect_gt ) ) return unexpectedToken( m_tokens[ m_cursor ], m_expect_gt );
+			++m_cursor;
+			return true;
+		}
+		if( !tokenIs( m_expect_gt ) ) return unexpectedToken( m_tokens[ m_cursor ], u"> or /" );
+		++m_cursor;
+		for(;;){
+			if( endOfTokens() ) return false;
+			if( tokenIsText() ){
+				text( m_tokens[ m_cursor ].name );
+				++m_cursor;
+				continue;
+			}
+			if( !tokenIs( m_expect_lt ) ) return unexpectedToken( m_tokens[ m_cursor ], m_expect_lt );
+			if( nextToken() ) return false;
+			if( tokenIs( m_expect_slash ) ){
+				if( nextToken() ) return false;
+				if( !closeNameMatches( name ) ) return unexpectedToken( m_tokens[ m_cursor ], name );
+				if( nextToken() ) return false;
+				if( !tokenIs( m_expect_gt ) ) return unexpectedToken( m_tokens[ m_cursor ], m_expect_gt );
+				++m_cursor;
+				return true;
+			}
+			if( !tokenIsName() ) return unexpectedToken( m_tokens[ m_cursor ], u"</close tag> or <new tag>" );
+			--m_cursor;
+			if( !child( m_tokens[ m_cursor + 1 ].name ) ) return false;
+		}
+	}
+	bool skipElement(){
+		return bindElement( []( const kkXMLString&, const kkXMLString& ){}, []( const kkXMLString& ){},
+			[this]( const kkXMLString& ){ return skipElement(); } );
+	}
+	template<typename T>
+	bool bindRecord( T& record ){
+		return bindElement(
+			[&record]( const kkXMLString& name, const kkXMLString& value ){
+				xmlutil::forEachField<T>( [&]( const auto& field ){
+					if constexpr( std::decay_t<decltype( field )>::kind == kkXMLFieldKind::Attribute ){
+						if( name == field.name ) xmlutil::bindText( value, record.*field.member );
+					}
+				});
+			},
+			[&record]( const kkXMLString& text ){
+				xmlutil::forEachField<T>( [&]( const auto& field ){
+					if constexpr( std::decay_t<decltype( field )>::kind == kkXMLFieldKind::Text )
+						xmlutil::bindText( text, record.*field.member );
+				});
+			},
+			[this, &record]( const kkXMLString& name ){
+				bool found = false;
+				bool ok = true;
+				xmlutil::forEachField<T>( [&]( const auto& field ){
+					if constexpr( std::decay_t<decltype( field )>::kind == kkXMLFieldKind::Element ){
+						if( !found && name == field.name ){
+							found = true;
+							ok = bindValue( record.*field.member );
+						}
+					}
+				});
+				return found ? ok : skipElement();
+			});
+	}
+	// Element into value of field
+	template<typename M>
+	bool bindValue( M& value ){
+		if constexpr( xmlutil::isBindArray<M>::value ){
+			value.emplace_back();
+			return bindValue( value.back() );
+		}else if constexpr( xmlutil::hasBinding<M>::value ){
+			return bindRecord( value );
+		}else{
+			return bindElement( []( const kkXMLString&, const kkXMLString& ){},
+				[&value]( const kkXMLString& text ){ xmlutil::bindText( text, value ); },
+				[this]( const kkXMLString& ){ return skipElement(); } );
+		}
+	}
+	// For readers that work on tokens. Moves m_cursor to root element.
+	bool tokenizeToRoot(){
+		{
+			kkXMLStatsTime( m_stats, kkXMLParsePhase::Tokenize );
+			getTokens();
+		}
+		kkXMLStatsAdd( m_stats, m_tokens, m_tokenCount );
+		m_sz = m_tokenCount;
+		if( !m_sz ){
+			m_error.code = kkXMLErrorCode::Empty;
+			return false;
+		}
+		skipProlog();
+		return !endOfTokens();
+	}
+	// Records are root element or its children
+	template<typename T>
+	bool bindRecords( kkArray<T>& out ){
+		bool ok = tokenizeToRoot();
+		kkXMLStatsTime( m_stats, kkXMLParsePhase::BuildTree );
+		if( ok ){
+			if( m_cursor + 1 < m_sz && m_tokens[ m_cursor + 1 ].name == kkXMLBinding<T>::name ){
+				out.emplace_back();
+				ok = bindRecord( out.back() );
+			}else{
+				ok = bindElement( []( const kkXMLString&, const kkXMLString& ){}, []( const kkXMLString& ){},
+					[this, &out]( const kkXMLString& name ){
+						if( name != kkXMLBinding<T>::name ) return skipElement();
+						out.emplace_back();
+						return bindRecord( out.back() );
+					});
+			}
+		}
+		m_tokenCount = 0;
+		return ok;
+	}
+	// Streaming XML to JSON, see TranscodeJSON. Text is scanned as it comes
+	// in windows, markup cut at end of a window is scanned again with the
+	// next one. Open elements are a stack of frames.
+	template<typename F>
+	class _jsonTranscoder{
+		enum _run{
+			run_none,
+			run_held,	// first of run, its output is kept
+			run_array,	// `[` written
+			run_single	// rest of run are repeated keys
+		};
+		struct _frame{
+			kkXMLString name;
+			kkXMLString text;		// written when element ends
+			bool object = false;	// `{` written
+			kkXMLString runName;	// name of last child
+			_run run = run_none;
+			size_t hold = 0;		// output position of first value of run
+		};
+		kkXMLDocumentT& m_doc;
+		const kkXMLJSONOptions& m_options;
+		xmlutil::JSONWriter<F> m_out;
+		// frames are reused, they keep capacity of their strings
+		kkArray<_frame> m_frames;
+		size_t m_depth = 0;
+		size_t m_holds = 0;
+		const char16_t* m_data = nullptr;
+		size_t m_base = 0;		// source offset of m_data
+		kkXMLString m_piece;	// text after last markup
+		kkXMLString m_name;
+		kkXMLString m_value;
+		bool m_root = false;
+		bool m_done = false;
+	public:
+		_jsonTranscoder( kkXMLDocumentT& doc, F& sink, const kkXMLJSONOptions& options )
+		:m_doc( doc ), m_options( options ), m_out( sink ){}
+		// Scans window of `size` characters. `used` is where markup that is
+		// not complete starts, or `size`; text before it is kept already.
+		bool feed( const char16_t* data, size_t size, bool last, size_t& used ){
+			kkXMLStatsTime( m_doc.m_stats, kkXMLParsePhase::Serialize );
+			m_data = data;
+			const char16_t* ptr = data;
+			const char16_t* end = data + size;
+			while( ptr < end && !m_done ){
+				if( *ptr != u'<' ){
+					const char16_t* lt = std::char_traits<char16_t>::find( ptr, (size_t)(end - ptr), u'<' );
+					if( !lt ) lt = end;
+					m_piece.append( ptr, (size_t)(lt - ptr) );
+					ptr = lt;
+					continue;
+				}
+				if( !endPiece( ptr ) ) return false;
+				size_t n = 0;
+				if( !markup( ptr, end, last, n ) ) return false;
+				if( !n ) break;
+				ptr += n;
+				if( m_holds && m_out.kept() > m_options.holdSize ) dropHolds();
+			}
+			if( m_done ) ptr = end;
+			used = (size_t)(ptr - data);
+			if( last && !m_done ){
+				if( !endPiece( end ) ) return false;
+				m_doc.m_error.code = m_root || ptr < end ? kkXMLErrorCode::UnexpectedEnd : kkXMLErrorCode::Empty;
+				m_doc.m_error.offset = offset( end );
+				return false;
+			}
+			m_base += used;
+			if( last ) m_out.flush();
+			return true;
+		}
+	private:
+		size_t offset( const char16_t* ptr ){ return m_base + (size_t)(ptr - m_data); }
+		bool unexpected( const char16_t* ptr, const char16_t* end, const kkXMLString& expected ){
+			kkXMLError& e = m_doc.m_error;
+			e.code = kkXMLErrorCode::UnexpectedToken;
+			e.offset = offset( ptr );
+			e.expected = expected;
+			e.found.clear();
+			if( ptr < end && xmlutil::isNameStartChar( *ptr ) ) scanName( ptr, end, e.found );
+			else if( ptr < end ) e.found += *ptr;
+			return false;
+		}
+		static const char16_t* skipSpace( const char16_t* ptr, const char16_t* end ){
+			while( ptr < end && xmlutil::isSpace( *ptr ) ) ++ptr;
+			return ptr;
+		}
+		static const char16_t* scanName( const char16_t* ptr, const char16_t* end, kkXMLString& name ){
+			const char16_t* begin = ptr;
+			while( ptr < end && xmlutil::isNameChar( *ptr ) ) ++ptr;
+			name.assign( begin, (size_t)(ptr - begin) );
+			return ptr;
+		}
+		// Text between markup, spaces handled like by tokenizer
+		bool endPiece( const char16_t* ptr ){
+			if( !m_piece.size() ) return true;
+			if constexpr( Policy::trimText )
+				xmlutil::stringTrimSpace( m_piece );
+			else{
+				size_t i = 0;
+				while( i < m_piece.size() && xmlutil::isSpace( m_piece[ i ] ) ) ++i;
+				m_piece.erase( 0, i );
+			}
+			if( m_piece.size() ){
+				if( !m_depth ){
+					unexpected( ptr, ptr, m_doc.m_expect_lt );
+					m_doc.m_error.offset -= m_piece.size();
+					m_doc.m_error.found = m_piece;
+					m_piece.clear();
+					return false;
+				}
+				m_doc.decodeEnts( m_piece );
+				m_frames[ m_depth - 1 ].text += m_piece;
+				m_piece.clear();
+			}
+			return true;
+		}
+		// Markup at `begin`, `used` stays 0 if its end is not in window.
+		bool markup( const char16_t* begin, const char16_t* end, bool last, size_t& used ){
+			std::u16string_view rest( begin, (size_t)(end - begin) );
+			if( rest.size() < 2 ) return true;
+			size_t close = 0;
+			if( rest[ 1 ] == u'?' ){
+				if( (close = rest.find( u"?>", 2 )) != std::u16string_view::npos ) used = close + 2;
+				return true;
+			}
+			if( rest[ 1 ] == u'!' ){
+				if( rest.compare( 0, 4, u"<!--" ) == 0 ){
+					if( (close = rest.find( u"-->", 4 )) != std::u16string_view::npos ) used = close + 3;
+				}else if( rest.compare( 0, 9, u"<![CDATA[" ) == 0 ){
+					if( (close = rest.find( u"]]>", 9 )) == std::u16string_view::npos ) return true;
+					if( !m_depth ) return unexpected( begin, end, m_doc.m_expect_lt );
+					m_frames[ m_depth - 1 ].text.append( begin + 9, close - 9 );
+					used = close + 3;
+				}else if( rest.size() >= 9 || last ){
+					// DOCTYPE, may have internal subset in [ ]
+					unsigned int depth = 0;
+					for( size_t i = 2; i < rest.size(); ++i ){
+						if( rest[ i ] == u'[' ) ++depth;
+						else if( rest[ i ] == u']' && depth ) --depth;
+						else if( rest[ i ] == u'>' && !depth ){
+							used = i + 1;
+							break;
+						}
+					}
+				}
+				return true;
+			}
+			if( rest[ 1 ] == u'/' ){
+				if( (close = rest.find( u'>', 2 )) == std::u16string_view::npos ) return true;
+				const char16_t* ptr = begin + 2;
+				if( !m_depth ) return unexpected( begin, end, m_doc.m_expect_lt );
+				ptr = scanName( ptr, end, m_name );
+				if constexpr( Policy::validate ){
+					if( m_name != m_frames[ m_depth - 1 ].name ) return unexpected( begin + 2, end, m_frames[ m_depth - 1 ].name );
+				}
+				ptr = skipSpace( ptr, end );
+				if( *ptr != u'>' ) return unexpected( ptr, end, m_doc.m_expect_gt );
+				endElement();
+				used = close + 1;
+				return true;
+			}
+			// start tag, first its end, `>` can be in attribute values
+			const char16_t* tagEnd = nullptr;
+			char16_t quote = 0;
+			for( const char16_t* p = begin + 1; p < end; ++p ){
+				if( quote ){
+					if( *p == quote ) quote = 0;
+				}else if( *p == u'\"' || *p == u'\'' ) quote = *p;
+				else if( *p == u'>' ){
+					tagEnd = p;
+					break;
+				}
+			}
+			if( !tagEnd ) return true;
+			const char16_t* ptr = begin + 1;
+			if( !xmlutil::isNameStartChar( *ptr ) ) return unexpected( ptr, end, u"name" );
+			ptr = scanName( ptr, tagEnd, m_name );
+			startElement( m_name );
+			for(;;){
+				ptr = skipSpace( ptr, tagEnd );
+				if( ptr == tagEnd ) break;
+				if( *ptr == u'/' ){
+					if( ptr + 1 != tagEnd ) return unexpected( ptr + 1, end, m_doc.m_expect_gt );
+					endElement();
+					break;
+				}
+				if( !xmlutil::isNameStartChar( *ptr ) ) return unexpected( ptr, end, u"attribute or / or >" );
+				ptr = scanName( ptr, tagEnd, m_name );
+				ptr = skipSpace( ptr, tagEnd );
+				if( ptr == tagEnd || *ptr != u'=' ) return unexpected( ptr, end, m_doc.m_expect_eq );
+				ptr = skipSpace( ptr + 1, tagEnd );
+				if( ptr == tagEnd || (*ptr != u'\"' && *ptr != u'\'') ) return unexpected( ptr, end, u"\' or \"" );
+				const char16_t* value = ptr + 1;
+				ptr = std::char_traits<char16_t>::find( value, (size_t)(tagEnd - value), *ptr );
+				if( !ptr ) return unexpected( tagEnd, end, u"\' or \"" );
+				m_value.assign( value, (size_t)(ptr - value) );
+				m_doc.decodeEnts( m_value );
+				_frame& f = m_frames[ m_depth - 1 ];
+				member( f, m_options.attributePrefix, m_name );
+				m_out.string( m_value );
+				++ptr;
+			}
+			used = (size_t)(tagEnd - begin) + 1;
+			return true;
+		}
+		void member( _frame& f, const kkXMLString& prefix, const kkXMLString& name ){
+			m_out.put( f.object ? ',' : '{' );
+			f.object = true;
+			m_out.key( prefix, name );
+		}
+		void startElement( const kkXMLString& name ){
+			static const kkXMLString noPrefix;
+			if( m_depth ){
+				_frame& parent = m_frames[ m_depth - 1 ];
+				bool same = parent.run != run_none && parent.runName == name;
+				if( same && parent.run == run_held ){
+					m_out.insert( parent.hold, '[' );
+					release( m_depth - 1 );
+					parent.run = run_array;
+				}
+				if( same && parent.run == run_array ) m_out.put( ',' );
+				else{
+					if( !same ) endRun( m_depth - 1 );
+					member( parent, noPrefix, name );
+					if( !same ){
+						parent.runName = name;
+						parent.run = run_single;
+						if( m_options.arrays ){
+							parent.run = run_held;
+							parent.hold = m_out.position();
+							if( !m_holds++ ) m_out.keep( parent.hold );
+						}
+					}
+				}
+			}else{
+				m_root = true;
+				m_out.put( '{' );
+				m_out.key( noPrefix, name );
+			}
+			if( m_depth == m_frames.size() ) m_frames.emplace_back();
+			_frame& f = m_frames[ m_depth++ ];
+			f.name = name;
+			f.text.clear();
+			f.object = false;
+			f.runName.clear();
+			f.run = run_none;
+		}
+		void endElement(){
+			_frame& f = m_frames[ m_depth - 1 ];
+			endRun( m_depth - 1 );
+			if( f.object ){
+				if( f.text.size() ){
+					m_out.put( ',' );
+					m_out.key( m_options.textKey, kkXMLString() );
+					m_out.string( f.text );
+				}
+				m_out.put( '}' );
+			}else if( f.text.size() ) m_out.string( f.text );
+			else m_out.put( "null" );
+			if( !--m_depth ){
+				m_out.put( '}' );
+				m_done = true;
+			}
+		}
+		void endRun( size_t frame ){
+			_frame& f = m_frames[ frame ];
+			if( f.run == run_array ) m_out.put( ']' );
+			else if( f.run == run_held ) release( frame );
+			f.run = run_none;
+		}
+		// Output of frames after `frame` may be kept still
+		size_t nextHold( size_t frame ){
+			for( ; frame < m_depth; ++frame ){
+				if( m_frames[ frame ].run == run_held ) return m_frames[ frame ].hold;
+			}
+			return xmlutil::JSONWriter<F>::npos;
+		}
+		void release( size_t frame ){
+			--m_holds;
+			if( m_out.keepPosition() == m_frames[ frame ].hold )
+				m_out.keep( nextHold( frame + 1 ) );
+		}
+		// Outermost runs give up, until output kept is small enough
+		void dropHolds(){
+			for( size_t i = 0; i < m_depth && m_out.kept() > m_options.holdSize; ++i ){
+				if( m_frames[ i ].run == run_held ){
+					release( i );
+					m_frames[ i ].run = run_single;
+					m_out.flush();
+				}
+			}
+		}
+	};
+	// Binding writer
+	template<typename M>
+	void writeValue( kkXMLString& outText, const M& value ){
+		if constexpr( std::is_same<M, kkXMLString>::value ) writeText( outText, value );
+		else xmlutil::formatValue( outText, value );
+	}
+	template<typename M>
+	void writeField( kkXMLString& outText, const char16_t* name, const M& value, unsigned int tabCount ){
+		if constexpr( xmlutil::isBindArray<M>::value ){
+			for( const auto& item : value ) writeField( outText, name, item, tabCount );
+		}else if constexpr( xmlutil::hasBinding<M>::value ){
+			writeRecord( outText, name, value, tabCount );
+		}else{
+			for( unsigned int o = 0; o < tabCount; ++o ) outText += u"\t";
+			outText += u"<";
+			outText += name;
+			outText += u">";
+			writeValue( outText, value );
+			outText += u"</";
+			outText += name;
+			outText += u">\r\n";
+		}
+	}
+	template<typename T>
+	void writeRecord( kkXMLString& outText, const char16_t* name, const T& record, unsigned int tabCount ){
+		for( unsigned int o = 0; o < tabCount; ++o ) outText += u"\t";
+		outText += u"<";
+		outText += name;
+		bool content = false;
+		xmlutil::forEachField<T>( [&]( const auto& field ){
+			if constexpr( std::decay_t<decltype( field )>::kind == kkXMLFieldKind::Attribute ){
+				outText += u" ";
+				outText += field.name;
+				outText += u"=\"";
+				if constexpr( std::is_same<std::decay_t<decltype( record.*field.member )>, kkXMLString>::value )
+					writeText( outText, record.*field.member, true );
+				else xmlutil::formatValue( outText, record.*field.member );
+				outText += u"\"";
+			}else content = true;
+		});
+		if( !content ){
+			outText += u"/>\r\n";
+			return;
+		}
+		outText += u">\r\n";
+		xmlutil::forEachField<T>( [&]( const auto& field ){
+			if constexpr( std::decay_t<decltype( field )>::kind == kkXMLFieldKind::Element )
+				writeField( outText, field.name, record.*field.member, tabCount + 1 );
+		});
+		xmlutil::forEachField<T>( [&]( const auto& field ){
+			if constexpr( std::decay_t<decltype( field )>::kind == kkXMLFieldKind::Text ){
+				kkXMLString text;
+				writeValue( text, record.*field.member );
+				if( text.size() ){
+					for( unsigned int o = 0; o <= tabCount; ++o ) outText += u"\t";
+					outText += text;
+					outText += u"\r\n";
+				}
+			}
+		});
+		for( unsigned int o = 0; o < tabCount; ++o ) outText += u"\t";
+		outText += u"</";
+		outText += name;
+		outText += u">\r\n";
+	}
+	// Token types, not contents: decoded text or attribute value can be `>`
+	bool tokenIsName(){
+		return m_tokens[ m_cursor ].type == _token_type::tt_default;
+	}
+	bool tokenIsText(){
+		return m_tokens[ m_cursor ].type == _token_type::tt_text;
+	}
+	bool tokenIs( const kkXMLString& symbol ){
+		return m_tokens[ m_cursor ].type == _token_type::tt_symbol && m_tokens[ m_cursor ].name == symbol;
+	}
 	bool nextToken(){
 		++m_cursor;
 		if( m_cursor >= m_sz ){
-			fprintf( stderr, "End of XML\n" );
+			m_error.code = kkXMLErrorCode::UnexpectedEnd;
+			m_error.offset = m_sourceSize;
 			return true;
 		}
 		return false;
 	}
-	bool unexpectedToken( const _token& token, kkXMLString expected ){
-		fwprintf( stderr, L"XML: Unexpected token: %s Line:%u Col:%u\n", (const wchar_t*)token.name.data(), token.line, token.col );
-		fwprintf( stderr, L"XML: Expected: %s\n", (const wchar_t*)expected.data() );
+	bool unexpectedToken( const _token& token, const kkXMLString& expected ){
+		m_error.code = kkXMLErrorCode::UnexpectedToken;
+		m_error.offset = token.offset;
+		m_error.expected = expected;
+		m_error.found = token.name;
 		return false;
 	}
 	void skipPrologAndDTD(){
-		unsigned int sz = (unsigned int)m_tokens.size();
+		size_t sz = m_tokenCount;
 		while( m_cursor < sz ){
-			if( m_tokens[ m_cursor ].name == m_expect_gt ){
+			if( tokenIs( m_expect_gt ) ){
 				++m_cursor;
 				return;
 			}else ++m_cursor;
@@ -1105,210 +4138,305 @@ class kkXMLDocument{
 			fwprintf( stdout, L"%s\n", (const wchar_t*)line.data() );
 			if( node->nodeList.size() ){
 				for( unsigned int i = 0; i < node->nodeList.size(); ++i ){
-					printNode( node->nodeList[ i ], ++indent );
-					--indent;
-				}
-			}
-		}
-	}
-	bool tokenIsString(){
-		return m_tokens[ m_cursor ].type == kkXMLDocument::_token_type::tt_string;
-	}
-	bool XPathGetTokens( std::vector<kkXPathToken> * arr, const kkXMLString& XPath_expression ){
-		kkXMLString expr = XPath_expression;
-		char16_t * ptr = expr.data();
-		kkXMLString name;
-		char16_t next;
-		while( *ptr ){		
-			name.clear();
-			next = *(ptr + 1);
-			kkXPathToken token;
-			if( *ptr == u'/' ){
-				if( next ){
-					if( next == u'/' ){
-						++ptr;
-						token.m_type = kkXPathTokenType::Double_slash;
-					}else token.m_type = kkXPathTokenType::Slash;
-				}else token.m_type = kkXPathTokenType::Slash;
-			}else if( *ptr == u'*' ){
-				token.m_type = kkXPathTokenType::Mul;
-			}else if( *ptr == u'=' ){
-				token.m_type = kkXPathTokenType::Equal;
-			}else if( *ptr == u'\'' ){
-				token.m_type = kkXPathTokenType::Apos;
-			}else if( *ptr == u'@' ){
-				token.m_type = kkXPathTokenType::Attribute;
-			}else if( *ptr == u'|' ){
-				token.m_type = kkXPathTokenType::Bit_or;
-			}else if( *ptr == u',' ){
-				token.m_type = kkXPathTokenType::Comma;
-			}else if( *ptr == u'+' ){
-				token.m_type = kkXPathTokenType::Add;
-			}else if( *ptr == u'+' ){
-				token.m_type = kkXPathTokenType::Sub;
-			}else if( *ptr == u'[' ){
-				token.m_type = kkXPathTokenType::Sq_open;
-			}else if( *ptr == u']' ){
-				token.m_type = kkXPathTokenType::Sq_close;
-			}else if( *ptr == u'(' ){
-				token.m_type = kkXPathTokenType::Function_open;
-			}else if( *ptr == u')' ){
-				token.m_type = kkXPathTokenType::Function_close;
-			}else if( *ptr == u'<' ){
-				if( next ){
-					if( next == u'=' ){
-						++ptr;
-						token.m_type = kkXPathTokenType::Less_eq;
-					}else token.m_type = kkXPathTokenType::Less;
-				}else token.m_type = kkXPathTokenType::Less;
-			}else if( *ptr == u'>' ){
-				if( next ){
-					if( next == u'/' ){
-						++ptr;
-						token.m_type = kkXPathTokenType::More_eq;
-					}else token.m_type = kkXPathTokenType::More;
-				}else token.m_type = kkXPathTokenType::More;
-			}else if( *ptr == u':' ){
-				if( next ){
-					if( next == u':' ){
-						++ptr;
-						token.m_type = kkXPathTokenType::Axis_namespace;
-					}else{
-						fprintf( stderr, "XPath: Bad token\n" );
-						return false;
-					}
-				}else{
-					fprintf( stderr, "XPath: Bad tokenn" );
-					return false;
-				}
-			}else if( *ptr == u'!' ){
-				if( next ){
-					if( next == u'=' ){
-						++ptr;
-						token.m_type = kkXPathTokenType::Not_equal;
-					}else{
-						fprintf( stderr, "XPath: Bad token\n" );
-						return false;
-					}
-				}else{
-					fprintf( stderr, "XPath: Bad token\n" );
-					return false;
+					printNode( node->nodeList[ i ], ++indent );
+					--indent;
 				}
-			}else if( XPathIsName( ptr ) ){
-				ptr = XPathGetName( ptr, &name );
-				token.m_type = kkXPathTokenType::Name;
-				token.m_string = name;
+			}
+		}
+	}
+	bool tokenIsString(){
+		return m_tokens[ m_cursor ].type == _token_type::tt_string;
+	}
+	// XPathGetNodes, XPathGetNodesByName, XPathGetNodesByAttribute and
+	// XPathWalk call f( node ) for nodes of the path in document order,
+	// they stop when it returns false.
+	template<typename F>
+	bool XPathGetNodes( unsigned int level, unsigned int maxLevel, const kkArray<kkXPathToken*>& elements, kkXMLNode* node, F& f ){
+	//_______________________________
+		if( xmlutil::XPathMatchStep( node, *elements[ level ] ) ){	
+			if( level == maxLevel ){
+				return f( node );
 			}else{
-				fprintf( stderr, "XPath: Bad token\n" );
-				return false;
+				size_t sz = node->nodeList.size();
+				for( size_t i = 0; i < sz; ++i ){
+					if( !XPathGetNodes( level + 1, maxLevel, elements, node->nodeList[ i ], f ) ) return false;
+				}
 			}
-			arr->push_back( token );
-			++ptr;
 		}
 		return true;
 	}
-	bool XPathIsName( char16_t * ptr ){
-		if( *ptr == u':' ){
-			if( *(ptr + 1) == u':' ) return false;
-		}
-		switch( *ptr ){
-		case u'/':
-		case u'*':
-		case u'\'':
-		case u',':
-		case u'=':
-		case u'+':
-		case u'-':
-		case u'@':
-		case u'[':
-		case u']':
-		case u'(':
-		case u')':
-		case u'|':
-		case u'!':
-			return false;
+
+	void collectNames( kkXMLNode* node ){
+		m_order.push_back( node );
+		m_orderAtoms.push_back( m_nameAtoms.intern( node->name ) );
+		size_t sz = node->nodeList.size();
+		for( size_t i = 0; i < sz; ++i ) collectNames( node->nodeList[ i ] );
+	}
+	void updateNameIndex(){
+		if( m_nameIndexValid && m_nameIndexVersion == m_root.m_version ) return;
+		m_nameAtoms.clear();
+		m_order.clear();
+		m_orderAtoms.clear();
+		collectNames( &m_root );
+		m_nameIndex.build( m_orderAtoms, m_order, m_nameAtoms.size() );
+		m_nameIndexValid = true;
+		m_nameIndexVersion = m_root.m_version;
+	}
+	// Path with `//` steps. Candidates are nodes named as the last step,
+	// from name index or from walk of whole tree.
+	template<typename F>
+	void XPathGetNodesByName( const kkArray<kkXPathToken*>& elements, F& f ){
+		size_t last = elements.size() - 1;
+		if( m_useNameIndex ){
+			updateNameIndex();
+			u32 atom = m_nameAtoms.find( elements[ last ]->m_string );
+			if( atom == kkXMLInvalidHandle ) return;
+			kkXMLNode* const* items = m_nameIndex.items( atom );
+			size_t sz = m_nameIndex.count( atom );
+			for( size_t i = 0; i < sz; ++i ){
+				if( xmlutil::XPathMatchStep( items[ i ], *elements[ last ] ) && xmlutil::XPathMatchAncestors( items[ i ], elements, last ) ){
+					if( !f( items[ i ] ) ) return;
+				}
+			}
+			return;
 		}
-		return true;
+		XPathWalk( &m_root, elements, f );
 	}
-	char16_t* XPathGetName( char16_t*ptr, kkXMLString * name ){
-		while( *ptr ){
-			if( XPathIsName( ptr ) ) *name += *ptr;
-			else break;
-			++ptr;
+
+	_attributeIndex* findAttributeIndex( const kkXMLString& Name ){
+		size_t sz = m_attributeIndexes.size();
+		for( size_t i = 0; i < sz; ++i ){
+			if( m_attributeIndexes[ i ].name == Name ) return &m_attributeIndexes[ i ];
 		}
-		--ptr;
-		return ptr;
+		return nullptr;
 	}
-	void XPathGetNodes( unsigned int level, unsigned int maxLevel, kkArray<kkXMLString*> elements, kkXMLNode* node, kkArray<kkXMLNode*>* outArr ){
-	//_______________________________
-		if( node->name == *elements[ level ] ){	
-			if( level == maxLevel ){
-				outArr->push_back( node );
-				return;
-			}else{
-				unsigned int sz = (unsigned int)node->nodeList.size();
-				for( unsigned int  i = 0; i < sz; ++i ){
-					XPathGetNodes( level + 1, maxLevel, elements, node->nodeList[ i ], outArr );
+	void collectAttributes( kkXMLNode* node ){
+		size_t isz = m_attributeIndexes.size();
+		size_t asz = node->attributeList.size();
+		for( size_t i = 0; i < isz; ++i ){
+			_attributeIndex& index = m_attributeIndexes[ i ];
+			for( size_t k = 0; k < asz; ++k ){
+				const kkXMLAttribute* a = node->attributeList[ k ];
+				if( a->name == index.name ){
+					index.order.push_back( node );
+					index.orderAtoms.push_back( index.values.intern( a->value ) );
+					break;
 				}
 			}
 		}
+		size_t sz = node->nodeList.size();
+		for( size_t i = 0; i < sz; ++i ) collectAttributes( node->nodeList[ i ] );
 	}
-
-	void writeText( kkXMLString& outText, const kkXMLString& inText ){
-		u32 sz = inText.size();
-		for( u32 i = 0; i < sz; ++i ){
-			if( inText[ i ] == u'\'' ){
-				outText += u"&apos;";
-			}else if( inText[ i ] == u'\"' ){
-				outText += u"&quot;";
-			}else if( inText[ i ] == u'<' ){
-				outText += u"&lt;";
-			}else if( inText[ i ] == u'>' ){
-				outText += u"&gt;";
-			}else if( inText[ i ] == u'&' ){
-				outText += u"&amp;";
-			}else{
-				outText += inText[ i ];
+	void updateAttributeIndex(){
+		if( m_attributeIndexValid && m_attributeIndexVersion == m_root.m_version ) return;
+		for( auto& index : m_attributeIndexes ){
+			index.values.clear();
+			index.order.clear();
+			index.orderAtoms.clear();
+		}
+		collectAttributes( &m_root );
+		for( auto& index : m_attributeIndexes )
+			index.nodes.build( index.orderAtoms, index.order, index.values.size() );
+		m_attributeIndexValid = true;
+		m_attributeIndexVersion = m_root.m_version;
+	}
+	// Nodes with this attribute value from the index, in document order.
+	void getIndexedNodes( _attributeIndex& index, const kkXMLString& Value, kkXMLNode* const*& items, size_t& count ){
+		updateAttributeIndex();
+		items = nullptr;
+		count = 0;
+		u32 atom = index.values.find( Value );
+		if( atom == kkXMLInvalidHandle ) return;
+		items = index.nodes.items( atom );
+		count = index.nodes.count( atom );
+	}
+	void collectByAttribute( kkXMLNode* node, const kkXMLString& Name, const kkXMLString& Value, kkArray<kkXMLNode*>& out ){
+		kkXMLAttribute* a = node->getAttribute( Name );
+		if( a && a->value == Value ) out.push_back( node );
+		size_t sz = node->nodeList.size();
+		for( size_t i = 0; i < sz; ++i ) collectByAttribute( node->nodeList[ i ], Name, Value, out );
+	}
+	kkXMLNode* findByAttribute( kkXMLNode* node, const kkXMLString& Name, const kkXMLString& Value ){
+		kkXMLAttribute* a = node->getAttribute( Name );
+		if( a && a->value == Value ) return node;
+		size_t sz = node->nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			if( kkXMLNode* found = findByAttribute( node->nodeList[ i ], Name, Value ) ) return found;
+		}
+		return nullptr;
+	}
+	// Last step has indexed predicate: candidates come from the attribute index.
+	template<typename F>
+	bool XPathGetNodesByAttribute( const kkArray<kkXPathToken*>& elements, F& f ){
+		size_t last = elements.size() - 1;
+		const kkXPathToken& step = *elements[ last ];
+		if( !step.m_predicate ) return false;
+		_attributeIndex* index = findAttributeIndex( step.m_attribute );
+		if( !index ) return false;
+		kkXMLNode* const* items;
+		size_t count;
+		getIndexedNodes( *index, step.m_value, items, count );
+		for( size_t i = 0; i < count; ++i ){
+			if( items[ i ]->name == step.m_string && xmlutil::XPathMatchAncestors( items[ i ], elements, last ) ){
+				if( !f( items[ i ] ) ) break;
 			}
 		}
+		return true;
+	}
+	template<typename F>
+	bool XPathWalk( kkXMLNode* node, const kkArray<kkXPathToken*>& elements, F& f ){
+		size_t last = elements.size() - 1;
+		if( xmlutil::XPathMatchStep( node, *elements[ last ] ) && xmlutil::XPathMatchAncestors( node, elements, last ) ){
+			if( !f( node ) ) return false;
+		}
+		size_t sz = node->nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			if( !XPathWalk( node->nodeList[ i ], elements, f ) ) return false;
+		}
+		return true;
+	}
+	// Nodes of path from XPathGetPath, from the best index for it.
+	template<typename F>
+	void XPathForEach( const kkArray<kkXPathToken*>& elements, F f ){
+		size_t sz = elements.size();
+		if( !sz ) return;
+		bool descendant = false;
+		for( size_t i = 0; i < sz; ++i )
+			if( elements[ i ]->m_axis == kkXPathAxis::Descendant ) descendant = true;
+		if( XPathGetNodesByAttribute( elements, f ) ) return;
+		if( descendant ) XPathGetNodesByName( elements, f );
+		else XPathGetNodes( 0, sz - 1, elements, &m_root, f );
+	}
+
+	// Runs without special chars are appended at once, entities only at
+	// hits. Quotes are escaped only in attribute values.
+	void writeText( kkXMLString& outText, const kkXMLString& inText, bool attribute = false ){
+		const char16_t* ptr = inText.data();
+		size_t sz = inText.size();
+		while( sz ){
+			size_t run = attribute ? xmlutil::escapeRun<true>( ptr, sz ) : xmlutil::escapeRun<false>( ptr, sz );
+			outText.append( ptr, run );
+			if( run == sz ) return;
+			outText += xmlutil::escapeEntity( ptr[ run ] );
+			ptr += run + 1;
+			sz -= run + 1;
+		}
 	}
 	void writeName( kkXMLString& outText, const kkXMLString& inText ){
 		outText += u"<";
 		outText += inText;
 	}
-	bool writeNodes( kkXMLString& outText, kkXMLNode* node, unsigned int tabCount ){
-		for( unsigned int i = 0; i < tabCount; ++i )
-			outText += u"\t";
-		++tabCount;
+	void writeSource( kkXMLString& outText, size_t begin, size_t end ){
+		outText.append( m_source + begin, end - begin );
+	}
+	// Source text before root element. Encoding named in XML declaration
+	// is replaced if it is not the output encoding, no encoding means
+	// UTF-8 or a BOM and is left out.
+	void writeProlog( kkXMLString& outText, size_t end, bool utf8 ){
+		std::u16string_view text( m_source, end );
+		size_t decl = 0;
+		while( decl < end && xmlutil::isSpace( text[ decl ] ) ) ++decl;
+		size_t declEnd = text.find( u"?>", decl );
+		size_t attr = std::u16string_view::npos;
+		if( declEnd != std::u16string_view::npos && text.compare( decl, 5, u"<?xml" ) == 0 )
+			attr = text.substr( 0, declEnd ).find( u"encoding", decl + 5 );
+		size_t quote = attr == std::u16string_view::npos ? declEnd : attr + 8;
+		while( quote < declEnd && text[ quote ] != u'"' && text[ quote ] != u'\'' ) ++quote;
+		size_t valueEnd = quote < declEnd ? text.find( text[ quote ], quote + 1 ) : declEnd;
+		if( attr == std::u16string_view::npos || valueEnd >= declEnd ){
+			writeSource( outText, 0, end );
+			return;
+		}
+		std::u16string_view value = text.substr( quote + 1, valueEnd - quote - 1 );
+		auto named = [ value ]( std::u16string_view name ){
+			if( value.size() != name.size() ) return false;
+			for( size_t i = 0; i < name.size(); ++i ){
+				char16_t c = value[ i ];
+				if( c >= u'a' && c <= u'z' ) c -= u'a' - u'A';
+				if( c != name[ i ] ) return false;
+			}
+			return true;
+		};
+		if( utf8 ? named( u"UTF-8" ) : ( named( u"UTF-16" ) || named( u"UTF-16LE" ) ) ){
+			writeSource( outText, 0, end );
+			return;
+		}
+		writeSource( outText, 0, quote + 1 );
+		outText += utf8 ? u"UTF-8" : u"UTF-16";
+		writeSource( outText, valueEnd, end );
+	}
+	// `node` is parsed and not changed itself. Everything except changed
+	// descendants is copied from source text.
+	void writeNodeSource( kkXMLString& outText, kkXMLNode* node, unsigned int tabCount ){
+		if( !node->m_subtreeDirty ){
+			writeSource( outText, node->m_sourceBegin, node->m_sourceEnd );
+			return;
+		}
+		size_t pos = node->m_sourceBegin;
+		size_t sz = node->nodeList.size();
+		for( size_t i = 0; i < sz; ++i ){
+			kkXMLNode* child = node->nodeList[ i ];
+			writeSource( outText, pos, child->m_sourceBegin );
+			if( child->m_dirty ) writeChangedNode( outText, child, tabCount + 1 );
+			else writeNodeSource( outText, child, tabCount + 1 );
+			pos = child->m_sourceEnd;
+		}
+		writeSource( outText, pos, node->m_sourceEnd );
+	}
+	// Re-emit changed node in place of its source. Indentation before it
+	// and line break after it are already in source text.
+	void writeChangedNode( kkXMLString& outText, kkXMLNode* node, unsigned int tabCount ){
+		if( writeNodes( outText, node, tabCount, false ) ){
+			outText.pop_back(); // \n
+			outText.pop_back(); // \r
+		}else{
+			for( unsigned int o = 0; o < tabCount; ++o ){
+				outText += u"\t";
+			}
+			outText += u"</";
+			outText += node->name;
+			outText += u">";
+		}
+	}
+	// `<name attributes`
+	void writeStartTag( kkXMLString& outText, kkXMLNode* node ){
 		writeName( outText, node->name );
-		unsigned int sz = (unsigned int)node->attributeList.size();
+		size_t sz = node->attributeList.size();
 		if( sz ){
-			for( unsigned int i = 0; i < sz; ++i ){
+			for( size_t i = 0; i < sz; ++i ){
 				outText += u" ";
 				outText += node->attributeList[ i ]->name;
 				outText += u"=";
 				outText += u"\"";
-				writeText( outText, node->attributeList[ i ]->value );
+				writeText( outText, node->attributeList[ i ]->value, true );
 				outText += u"\"";
 			}
 		}
-		if( !node->nodeList.size() && !node->text.size() ){
-			outText += u"/>\r\n";
-			return true;
-		}else{
-			outText += u">\r\n";
-			sz = (unsigned int)node->nodeList.size();
-			for( unsigned int i = 0; i < sz; ++i ){
-				if( !writeNodes( outText, node->nodeList[ i ], tabCount ) ){
-					for( unsigned int o = 0; o < tabCount; ++o ){
-						outText += u"\t";
-					}
-					outText += u"</";
-					outText += node->nodeList[ i ]->name;
-					outText += u">\n";
+	}
+	// Children of `node` in [ begin, end ), `tabCount` is their depth.
+	void writeChildren( kkXMLString& outText, kkXMLNode* node, size_t begin, size_t end, unsigned int tabCount ){
+		for( size_t i = begin; i < end; ++i ){
+			kkXMLNode* child = node->nodeList[ i ];
+			if( child->hasSource() && !child->m_dirty ){
+				for( unsigned int o = 0; o < tabCount; ++o ){
+					outText += u"\t";
+				}
+				writeNodeSource( outText, child, tabCount );
+				outText += u"\r\n";
+				continue;
+			}
+			if( !writeNodes( outText, child, tabCount ) ){
+				for( unsigned int o = 0; o < tabCount; ++o ){
+					outText += u"\t";
 				}
+				outText += u"</";
+				outText += node->nodeList[ i ]->name;
+				outText += u">\n";
 			}
 		}
+	}
+	// Text of element with children, after them.
+	void writeTrailingText( kkXMLString& outText, kkXMLNode* node, unsigned int tabCount ){
 		if( node->text.size() ){
 			for( unsigned int o = 0; o < tabCount; ++o ){
 				outText += u"\t";
@@ -1316,50 +4444,494 @@ class kkXMLDocument{
 			writeText( outText, node->text );
 			outText += u"\n";
 		}
+	}
+	bool writeNodes( kkXMLString& outText, kkXMLNode* node, unsigned int tabCount, bool indentFirst = true ){
+		if( indentFirst ){
+			for( unsigned int i = 0; i < tabCount; ++i )
+				outText += u"\t";
+		}
+		++tabCount;
+		writeStartTag( outText, node );
+		if( !node->nodeList.size() && !node->text.size() ){
+			outText += u"/>\r\n";
+			return true;
+		}else{
+			outText += u">\r\n";
+			writeChildren( outText, node, 0, node->nodeList.size(), tabCount );
+		}
+		writeTrailingText( outText, node, tabCount );
 		--tabCount;
 		return false;
 	}
+
+	// Parallel Write. Children of root are split into chunks of about the
+	// same number of nodes, threads take chunks one by one and serialize
+	// them (and transcode for UTF-8) into their own buffers.
+	unsigned int m_writeThreads = 0;
+	struct _writeChunk{
+		size_t begin = 0;
+		size_t end = 0;
+		kkXMLString text;
+		kkXMLStringA utf8;
+	};
+	static size_t countNodes( const kkXMLNode* node ){
+		size_t n = 1;
+		size_t sz = node->nodeList.size();
+		for( size_t i = 0; i < sz; ++i ) n += countNodes( node->nodeList[ i ] );
+		return n;
+	}
+	// Thread count for this tree, 1 - write on calling thread.
+	unsigned int writeThreadCount(){
+		unsigned int threads = m_writeThreads ? m_writeThreads : std::thread::hardware_concurrency();
+		size_t sz = m_root.nodeList.size();
+		if( threads > sz ) threads = (unsigned int)sz;
+		if( threads < 2 ) return 1;
+		if( !m_writeThreads && countNodes( &m_root ) < xmlutil::parallelWriteMinNodes ) return 1;
+		return threads;
+	}
+	void writeChunks( kkArray<_writeChunk>& chunks, unsigned int threads, bool utf8 ){
+		size_t sz = m_root.nodeList.size();
+		kkArray<size_t> weights( sz );
+		size_t total = 0;
+		for( size_t i = 0; i < sz; ++i ){
+			weights[ i ] = countNodes( m_root.nodeList[ i ] );
+			total += weights[ i ];
+		}
+		// few chunks per thread, so a big subtree does not keep others waiting
+		size_t target = total / ((size_t)threads * 4u) + 1u;
+		size_t weight = 0;
+		size_t begin = 0;
+		for( size_t i = 0; i < sz; ++i ){
+			weight += weights[ i ];
+			if( weight >= target || i + 1 == sz ){
+				chunks.push_back( _writeChunk() );
+				chunks.back().begin = begin;
+				chunks.back().end = i + 1;
+				begin = i + 1;
+				weight = 0;
+			}
+		}
+		std::atomic<size_t> next( 0 );
+		auto work = [&](){
+			for(;;){
+				size_t i = next++;
+				if( i >= chunks.size() ) return;
+				_writeChunk& chunk = chunks[ i ];
+				writeChildren( chunk.text, &m_root, chunk.begin, chunk.end, 1 );
+				if( utf8 ){
+					xmlutil::string_UTF16_to_UTF8( chunk.text, chunk.utf8 );
+					kkXMLString().swap( chunk.text );
+				}
+			}
+		};
+		std::vector<std::thread> pool;
+		for( unsigned int i = 1; i < threads; ++i ) pool.emplace_back( work );
+		work();
+		for( auto& t : pool ) t.join();
+	}
+	void beginParse(){
+		m_error.clear();
+		recycleChildren( &m_root );
+		m_root.name.clear();
+		m_root.text.clear();
+		m_tokenCount = 0;
+		m_nameIndexValid = false;
+		m_attributeIndexValid = false;
+		m_orderValid = false;
+		m_isInit = false;
+	}
+	void setSource( const char16_t* text, size_t size ){
+		m_ownsSource = text == m_text.data();
+		// BOM
+		if( size && *text == 0xFEFF ){
+			++text;
+			--size;
+		}
+		m_source = text;
+		m_sourceSize = size;
+	}
 	bool init(){
-		_initExpectStrings();
-		if( kkFileExist( m_fileName.data() ) ){
-			if( !xmlutil::readTextFromFileForUnicode( m_fileName, m_text ) )
+		if( kkFileExist( m_fileName.data() ) )
+			return ReadFile( m_fileName );
+		beginParse();
+		m_text = m_fileName;
+		setSource( m_text.data(), m_text.size() );
+		return parse();
+	}
+	bool parse(){
+		{
+			kkXMLStatsTime( m_stats, kkXMLParsePhase::Tokenize );
+			getTokens();
+		}
+		kkXMLStatsAdd( m_stats, m_tokens, m_tokenCount );
+		{
+			kkXMLStatsTime( m_stats, kkXMLParsePhase::BuildTree );
+			m_depth = 0;
+			if( !analyzeTokens() ) 
 				return false;
-		}else
-			m_text = m_fileName;
-		getTokens();
-		if( !analyzeTokens() ) 
-			return false;
-		m_tokens.clear();
+		}
+		m_tokenCount = 0;
 		m_isInit = true;
 		return true;
 	}
 public:
-	kkXMLDocument(){}
-	~kkXMLDocument(){}
+	kkXMLDocumentT(){}
+	~kkXMLDocumentT(){ ReleaseMemory(); }
+	kkXMLDocumentT( const kkXMLDocumentT& ) = delete;
+	kkXMLDocumentT& operator=( const kkXMLDocumentT& ) = delete;
+	kkXMLDocumentT( kkXMLDocumentT&& doc ) noexcept { *this = std::move( doc ); }
+	kkXMLDocumentT& operator=( kkXMLDocumentT&& doc ) noexcept {
+		if( this != &doc ){
+			// own tree and pools first, they must not take the moved tree with them
+			ReleaseMemory();
+			m_isInit   = doc.m_isInit;
+			m_root     = std::move( doc.m_root );
+			m_fileName = std::move( doc.m_fileName );
+			// caller's buffer is not in m_text, no offset for it
+			size_t sourceOffset = doc.m_ownsSource ? doc.m_source - doc.m_text.data() : 0;
+			m_text     = std::move( doc.m_text );
+			m_ownsSource = doc.m_ownsSource;
+			m_source   = m_ownsSource ? m_text.data() + sourceOffset : doc.m_source;
+			m_sourceSize = doc.m_sourceSize;
+			m_stats    = doc.m_stats;
+			m_error    = std::move( doc.m_error );
+			m_attributeIndexes = std::move( doc.m_attributeIndexes );
+			m_useNameIndex = doc.m_useNameIndex;
+			m_writeThreads = doc.m_writeThreads;
+			m_tokens   = std::move( doc.m_tokens );
+			m_freeNodes = std::move( doc.m_freeNodes );
+			m_freeAttributes = std::move( doc.m_freeAttributes );
+			m_tokenCount = 0;
+			m_nameIndexValid = false;
+			m_attributeIndexValid = false;
+			m_orderValid = false;
+			doc.m_isInit = false;
+			doc.m_source = nullptr;
+			doc.m_sourceSize = 0;
+			doc.m_ownsSource = false;
+		}
+		return *this;
+	}
+	// Deep copy of the tree. Parse state is not copied.
+	void Clone( kkXMLDocumentT& out ) const {
+		out.m_root = m_root;
+		out.m_fileName = m_fileName;
+		out.m_text.assign( m_source ? m_source : u"", m_sourceSize );
+		out.m_source = out.m_text.data();
+		out.m_sourceSize = out.m_text.size();
+		out.m_ownsSource = true;
+		out.m_isInit = m_isInit;
+		out.m_nameIndexValid = false;
+		out.m_attributeIndexValid = false;
+		out.m_orderValid = false;
+	}
+	// Clears the document but keeps its memory (text, tokens, nodes and
+	// attributes) for the next parse. Parsing messages of similar size
+	// into a reset document does not allocate. ReadFile still starts a
+	// reading thread, which allocates, for files of readAheadMinSize and more.
+	void Reset(){
+		beginParse();
+		m_text.clear();
+		m_source = nullptr;
+		m_sourceSize = 0;
+		m_ownsSource = false;
+		m_fileName.clear();
+	}
+	// Frees memory kept by Reset.
+	void ReleaseMemory(){
+		recycleChildren( &m_root );
+		for( auto * n : m_freeNodes ) kkDestroy( n );
+		for( auto * a : m_freeAttributes ) kkDestroy( a );
+		m_freeNodes.clear();
+		m_freeNodes.shrink_to_fit();
+		m_freeAttributes.clear();
+		m_freeAttributes.shrink_to_fit();
+		m_tokens.clear();
+		m_tokens.shrink_to_fit();
+		m_tokenCount = 0;
+		m_str.clear();
+		m_str.shrink_to_fit();
+		m_bytes.clear();
+		m_bytes.shrink_to_fit();
+		m_nameIndexValid = false;
+		m_nameAtoms.clear();
+		m_nameIndex.clear();
+		m_order.clear();
+		m_order.shrink_to_fit();
+		m_orderAtoms.clear();
+		m_orderAtoms.shrink_to_fit();
+		m_orderValid = false;
+		m_sorted.clear();
+		m_sorted.shrink_to_fit();
+		// declared indexes stay, their contents are built again on next use
+		m_attributeIndexValid = false;
+		for( auto& index : m_attributeIndexes ){
+			index.values.clear();
+			index.nodes.clear();
+			index.order.clear();
+			index.order.shrink_to_fit();
+			index.orderAtoms.clear();
+			index.orderAtoms.shrink_to_fit();
+		}
+	}
+private:
+	// m_fileName into m_text
+	bool readText(){
+		m_text.clear();
+		if( xmlutil::readTextFromFileForUnicode( m_fileName, m_text, m_stats, &m_bytes, &m_error.code ) ) return true;
+		m_text.clear();
+		return false;
+	}
+public:
+	// `file` is a path if such file exists, otherwise it is XML text.
 	bool Read( const kkXMLString& file )
 	{
 		m_fileName = file;
 		return init();
 	}
+	// `file` is always a path.
+	bool ReadFile( const kkXMLString& file )
+	{
+		beginParse();
+		if( &m_fileName != &file ) m_fileName = file;
+		if( !readText() ) return false;
+		setSource( m_text.data(), m_text.size() );
+		return parse();
+	}
+	// Parse XML text from memory, no file system access.
+	// UTF-16 buffer is not copied: it must stay alive and unchanged while
+	// this document is used (Write copies unchanged parts from it).
+	bool ParseBuffer( const char16_t* text, size_t size )
+	{
+		beginParse();
+		m_fileName.clear();
+		m_text.clear();
+		setSource( text, size );
+		return parse();
+	}
+	// Same, but document takes ownership of the text.
+	bool ParseBuffer( kkXMLString&& text )
+	{
+		beginParse();
+		m_fileName.clear();
+		m_text = std::move( text );
+		setSource( m_text.data(), m_text.size() );
+		return parse();
+	}
+	// UTF-8 text is converted to UTF-16 and stored in document.
+	bool ParseBuffer( const char* utf8, size_t size )
+	{
+		beginParse();
+		m_fileName.clear();
+		m_text.clear();
+		{
+			kkXMLStatsTime( m_stats, kkXMLParsePhase::Transcode );
+			if( size >= 3 && (unsigned char)utf8[0] == 0xEF && (unsigned char)utf8[1] == 0xBB && (unsigned char)utf8[2] == 0xBF ){
+				utf8 += 3;
+				size -= 3;
+			}
+			xmlutil::string_UTF8_to_UTF16( m_text, utf8, size );
+		}
+		setSource( m_text.data(), m_text.size() );
+		return parse();
+	}
+	// Records of kkXMLBinding<T> straight from text, no nodes are made:
+	// root element if it has the record name, otherwise its children with
+	// this name. Other elements are skipped. The document is cleared.
+	template<typename T>
+	bool ParseRecords( const char16_t* text, size_t size, kkArray<T>& out )
+	{
+		beginParse();
+		m_fileName.clear();
+		m_text.clear();
+		setSource( text, size );
+		return bindRecords( out );
+	}
+	template<typename T>
+	bool ReadRecords( const kkXMLString& file, kkArray<T>& out )
+	{
+		beginParse();
+		if( &m_fileName != &file ) m_fileName = file;
+		if( !readText() ) return false;
+		setSource( m_text.data(), m_text.size() );
+		return bindRecords( out );
+	}
+	// XML to JSON in one pass, no tokens or nodes are kept, see
+	// kkXMLJSONOptions. `sink( const char* data, size_t size )` gets UTF-8
+	// text in parts; after an error it may have got only a part of JSON.
+	// Memory does not grow with the document, only with depth, text of open
+	// elements and kkXMLJSONOptions::holdSize. The document is cleared.
+	template<typename F>
+	bool TranscodeJSON( const char16_t* text, size_t size, F sink, const kkXMLJSONOptions& options = kkXMLJSONOptions() )
+	{
+		beginParse();
+		m_fileName.clear();
+		m_text.clear();
+		setSource( text, size );
+		_jsonTranscoder<F> json( *this, sink, options );
+		size_t used = 0;
+		return json.feed( text, size, true, used );
+	}
+	// XML file to UTF-8 JSON file. The XML file is read and decoded in
+	// chunks, its text is not held whole. Error offset counts from start of
+	// file text, GetErrorPosition can not find it. JSON file is not touched
+	// until there is output, failed writes give kkXMLErrorCode::FileWrite.
+	bool WriteJSON( const kkXMLString& xmlFile, const kkXMLString& jsonFile, const kkXMLJSONOptions& options = kkXMLJSONOptions() )
+	{
+		beginParse();
+		if( &m_fileName != &xmlFile ) m_fileName = xmlFile;
+		m_text.clear();
+		// output is created with the first bytes, when input was read
+		kkPtr<kkFile> out;
+		bool written = true;
+		auto sink = [&]( const char* data, size_t size ){
+			if( !written ) return;
+			kkXMLStatsTime( m_stats, kkXMLParsePhase::FileIO );
+			if( !out.ptr() ) out = xmlutil::createFileForWriteBin( jsonFile );
+			written = out->m_handle && out->write( (unsigned char*)data, size ) == size;
+			kkXMLStatsAdd( m_stats, m_bytesWritten, size );
+		};
+		_jsonTranscoder<decltype( sink )> json( *this, sink, options );
+		bool ok = true;
+		kkXMLErrorCode readError = kkXMLErrorCode::None;
+		// m_text is the window; after an error the rest is read and dropped
+		bool read = xmlutil::readTextFromFileInChunks( m_fileName, m_text, [&]( kkXMLString& window, bool last ){
+			size_t used = window.size();
+			if( ok ) ok = json.feed( window.data(), window.size(), last, used );
+			window.erase( 0, ok ? used : window.size() );
+		}, m_stats, &m_bytes, &readError );
+		m_text.clear();
+		if( ok && !read ) m_error.code = readError;
+		else if( ok && !written ) m_error.code = kkXMLErrorCode::FileWrite;
+		return ok && read && written;
+	}
+	bool Read( const kkXMLString& file, kkXMLError& error )
+	{
+		bool ok = Read( file );
+		error = m_error;
+		return ok;
+	}
+	const kkXMLError& GetError() const {return m_error;}
+	// Line and column (both from 1) of last error. Rescans source text.
+	// False for no error and for BadXPath, which is not in the source.
+	bool GetErrorPosition( size_t& line, size_t& col ) const {
+		line = 1;
+		col = 1;
+		if( m_error.code == kkXMLErrorCode::None || m_error.code == kkXMLErrorCode::BadXPath ) return false;
+		size_t sz = m_sourceSize;
+		if( m_error.offset < sz ) sz = m_error.offset;
+		for( size_t i = 0; i < sz; ++i ){
+			if( m_source[ i ] == u'\n' ){
+				++line;
+				col = 1;
+			}else ++col;
+		}
+		return true;
+	}
+	// If document was parsed, unchanged subtrees (and everything outside
+	// root element, including prolog) are copied from source text as is,
+	// only nodes changed through kkXMLNode methods are serialized again.
+	// Declared encoding is changed to match `utf8`.
+	// Big trees are serialized on several threads, see SetWriteThreads, when
+	// the root itself is written again: new or reset trees, or a changed root
+	// element. Changes below a parsed root are written on the calling thread.
 	void Write( const kkXMLString& file, bool utf8 ){
-		kkXMLString outText( u"<?xml version=\"1.0\"" );
+		kkXMLString outText;
+		// parallel Write: root start tag is in outText, then chunks, then tail
+		kkArray<_writeChunk> chunks;
+		kkXMLString tail;
+		{
+		kkXMLStatsTime( m_stats, kkXMLParsePhase::Serialize );
+		if( m_root.hasSource() ){
+			outText.reserve( m_sourceSize );
+			writeProlog( outText, m_root.m_sourceBegin, utf8 );
+			unsigned int threads = m_root.m_dirty ? writeThreadCount() : 1;
+			if( threads > 1 ){
+				// as writeChangedNode, children in parallel
+				writeStartTag( outText, &m_root );
+				outText += u">\r\n";
+				writeChunks( chunks, threads, utf8 );
+				writeTrailingText( tail, &m_root, 1 );
+				tail += u"</";
+				tail += m_root.name;
+				tail += u">";
+				writeSource( tail, m_root.m_sourceEnd, m_sourceSize );
+			}else{
+				if( m_root.m_dirty ) writeChangedNode( outText, &m_root, 0 );
+				else writeNodeSource( outText, &m_root, 0 );
+				writeSource( outText, m_root.m_sourceEnd, m_sourceSize );
+			}
+		}else{
+			// about the same size as parsed text, if there was one
+			outText.reserve( m_sourceSize );
+			outText = u"<?xml version=\"1.0\"";
+			if( utf8 ) outText += u" encoding=\"UTF-8\"";
+			outText += u" ?>\r\n";
+			unsigned int threads = writeThreadCount();
+			if( threads > 1 ){
+				writeStartTag( outText, &m_root );
+				outText += u">\r\n";
+				writeChunks( chunks, threads, utf8 );
+				writeTrailingText( tail, &m_root, 1 );
+				tail += u"</";
+				tail += m_root.name;
+				tail += u">\n";
+			}else if( !writeNodes( outText, &m_root, 0 ) ){
+				outText += u"</";
+				outText += m_root.name;
+				outText += u">\n";
+			}
+		}
+		}
+		writeFile( file, outText, chunks, tail, utf8 );
+	}
+	// Records as children of element `rootName`, see kkXMLBinding.
+	template<typename T>
+	void WriteRecords( const kkXMLString& file, const kkXMLString& rootName, const kkArray<T>& records, bool utf8 ){
+		kkXMLString outText;
+		{
+		kkXMLStatsTime( m_stats, kkXMLParsePhase::Serialize );
+		outText = u"<?xml version=\"1.0\"";
 		if( utf8 ) outText += u" encoding=\"UTF-8\"";
-		outText += u" ?>\r\n";
-		writeNodes( outText, &m_root, 0 );
+		outText += u" ?>\r\n<";
+		outText += rootName;
+		outText += u">\r\n";
+		for( const auto& record : records ) writeRecord( outText, kkXMLBinding<T>::name, record, 1 );
 		outText += u"</";
-		outText += m_root.name;
-		outText += u">\n";
-		auto out = xmlutil::createFileForWriteText( file );
+		outText += rootName;
+		outText += u">\r\n";
+		}
+		writeFile( file, outText, kkArray<_writeChunk>(), kkXMLString(), utf8 );
+	}
+private:
+	void writeFile( const kkXMLString& file, const kkXMLString& outText, const kkArray<_writeChunk>& chunks, const kkXMLString& tail, bool utf8 ){
+		kkXMLStatsTime( m_stats, kkXMLParsePhase::FileIO );
+		kkPtr<kkFile> out = xmlutil::createFileForWriteText( file );
 		kkTextFileInfo ti;
 		ti.m_hasBOM = true;
 		if( utf8 ){
 			ti.m_format = kkTextFileFormat::UTF_8;
 			out->setTextFileInfo( ti );
 			kkXMLStringA mbstr;
+			{
+			kkXMLStatsTime( m_stats, kkXMLParsePhase::Transcode );
 			xmlutil::string_UTF16_to_UTF8( outText, mbstr );
+			}
 			if( ti.m_hasBOM )
 				out->write( kkXMLStringA("\xEF\xBB\xBF") );
 			out->write( mbstr );
+			kkXMLStatsAdd( m_stats, m_bytesWritten, mbstr.size() );
+			// chunks in order, without joining them into one buffer
+			for( const auto& chunk : chunks ){
+				out->write( chunk.utf8 );
+				kkXMLStatsAdd( m_stats, m_bytesWritten, chunk.utf8.size() );
+			}
+			if( tail.size() ){
+				mbstr.clear();
+				xmlutil::string_UTF16_to_UTF8( tail, mbstr );
+				out->write( mbstr );
+				kkXMLStatsAdd( m_stats, m_bytesWritten, mbstr.size() );
+			}
 		}else{
 			ti.m_endian = kkTextFileEndian::Little;
 			ti.m_format = kkTextFileFormat::UTF_16;
@@ -1367,118 +4939,260 @@ public:
 				out->write( kkXMLStringA("\xFF\xFE") );
 			out->setTextFileInfo( ti );
 			out->write( outText );
+			kkXMLStatsAdd( m_stats, m_bytesWritten, outText.size() * sizeof(char16_t) );
+			for( const auto& chunk : chunks ){
+				out->write( chunk.text );
+				kkXMLStatsAdd( m_stats, m_bytesWritten, chunk.text.size() * sizeof(char16_t) );
+			}
+			if( tail.size() ){
+				out->write( tail );
+				kkXMLStatsAdd( m_stats, m_bytesWritten, tail.size() * sizeof(char16_t) );
+			}
 		}
 	}
+public:
 	kkXMLNode* GetRootNode(){return &m_root;}
+	// Structural hash of whole document, see kkXMLNode::hash.
+	unsigned long long GetHash(){ return m_root.hash(); }
+	// Changes from this document to `doc`, see kkXMLDiff.
+	template<typename P>
+	void Diff( kkXMLDocumentT<P>& doc, kkArray<kkXMLChange>& out ){ kkXMLDiff( &m_root, doc.GetRootNode(), out ); }
+	// Read, Write and SelectNodes add their numbers to `stats`, nullptr to stop.
+	// Works only with KK_XML_STATS.
+	void SetStats( kkXMLParseStats* stats ){m_stats = stats;}
+	// Threads used by Write when root element is serialized. 0 - one per core
+	// for big trees (default), 1 - calling thread only.
+	void SetWriteThreads( unsigned int threads ){m_writeThreads = threads;}
+	// False above 2^32 - 1 nodes, see kkXMLCompactTree::build.
+	bool BuildCompactTree( kkXMLCompactTree& out ) const { return out.build( &m_root ); }
+	// Snapshot for concurrent readers. Later changes of this document are
+	// not visible in it.
+	bool Freeze( kkXMLFrozenDocument& out ) const { return out.build( &m_root ); }
+	// Name index makes `//Name` steps of SelectNodes a scan of nodes with this
+	// name instead of walk of whole tree. It is on by default and costs
+	// about 12 bytes per element.
+	void SetNameIndex( bool enable ){
+		m_useNameIndex = enable;
+		if( !enable ){
+			m_nameIndexValid = false;
+			m_nameAtoms.clear();
+			m_nameIndex.clear();
+		}
+	}
+	// Parser numbers nodes in pre-order and post-order, so axis tests of
+	// kkXMLNode are integer comparisons. After the tree is changed through
+	// kkXMLNode methods call this before using them.
+	void UpdateOrder(){
+		if( m_orderValid && m_orderVersion == m_root.m_version ) return;
+		m_preCount = m_postCount = 0;
+		numberNodes( &m_root );
+		m_orderValid = true;
+		m_orderVersion = m_root.m_version;
+	}
+	// Document order without duplicates, for nodes of this document.
+	void SortDocumentOrder( kkArray<kkXMLNode*>& nodes ){
+		UpdateOrder();
+		xmlutil::sortUnique( nodes, m_sorted, []( const kkXMLNode* n ){ return n->m_pre; } );
+	}
+	// Index of attribute values, for GetElementsByAttribute and for
+	// SelectNodes paths that end with `name[@Name='value']`. Kept after
+	// Reset and ReleaseMemory, built again after the tree is changed.
+	void AddAttributeIndex( const kkXMLString& Name ){
+		if( findAttributeIndex( Name ) ) return;
+		m_attributeIndexes.push_back( _attributeIndex() );
+		m_attributeIndexes.back().name = Name;
+		m_attributeIndexValid = false;
+	}
+	void RemoveAttributeIndex( const kkXMLString& Name ){
+		size_t sz = m_attributeIndexes.size();
+		for( size_t i = 0; i < sz; ++i ){
+			if( m_attributeIndexes[ i ].name == Name ){
+				m_attributeIndexes.erase( m_attributeIndexes.begin() + i );
+				return;
+			}
+		}
+	}
+	// All elements where attribute `Name` is `Value`, in document order.
+	// Without index for `Name` whole tree is walked.
+	void GetElementsByAttribute( const kkXMLString& Name, const kkXMLString& Value, kkArray<kkXMLNode*>& out ){
+		out.clear();
+		if( !m_isInit ) return;
+		_attributeIndex* index = findAttributeIndex( Name );
+		if( !index ){
+			collectByAttribute( &m_root, Name, Value, out );
+			return;
+		}
+		kkXMLNode* const* items;
+		size_t count;
+		getIndexedNodes( *index, Value, items, count );
+		for( size_t i = 0; i < count; ++i ) out.push_back( items[ i ] );
+	}
+	// First element where attribute `Name` is `Value`, or nullptr.
+	kkXMLNode* GetElementByAttribute( const kkXMLString& Name, const kkXMLString& Value ){
+		if( !m_isInit ) return nullptr;
+		_attributeIndex* index = findAttributeIndex( Name );
+		if( !index ) return findByAttribute( &m_root, Name, Value );
+		kkXMLNode* const* items;
+		size_t count;
+		getIndexedNodes( *index, Value, items, count );
+		return count ? items[ 0 ] : nullptr;
+	}
+	kkXMLNode* GetElementById( const kkXMLString& Value ){ return GetElementByAttribute( u"id", Value ); }
 	void Print(){
 		printf( "XML:\n" );
 		printNode( &m_root, 0 );
 	}
+	// Text owned by document. Empty if it was parsed from caller's UTF-16 buffer.
 	const kkXMLString& GetText(){return m_text;}
+	// Text that was parsed, owned or not.
+	std::u16string_view GetSource() const {return std::u16string_view( m_source ? m_source : u"", m_sourceSize );}
+	// Lazy variant of SelectNodes, nodes are found while iterating:
+	//	if( auto* node = xml.Select( u"/Project/ItemGroup" ).first() ) ...
+	// Unions are merged in document order while iterating too.
+	// Bad expression gives empty range and sets GetError().
+	kkXMLRange<kkXMLPathCursor> Select( const kkXMLString& XPath_expression ){
+		if( xmlutil::XPathFindUnion( XPath_expression, 0 ) == XPath_expression.size() )
+			return kkXMLRange<kkXMLPathCursor>( selectCursor( XPath_expression ) );
+		std::vector<kkXMLPathCursor> branches;
+		size_t pos = 0;
+		while( xmlutil::XPathNextUnionPart( XPath_expression, pos, m_XPathPart ) ){
+			if( !m_XPathPart.size() ){
+				xmlutil::XPathError( &m_error, XPath_expression, u"path", pos - 1 );
+				return kkXMLRange<kkXMLPathCursor>( kkXMLPathCursor() );
+			}
+			branches.push_back( selectCursor( m_XPathPart ) );
+			if( !branches.back().m_root ) return kkXMLRange<kkXMLPathCursor>( kkXMLPathCursor() );
+		}
+		UpdateOrder();
+		return kkXMLRange<kkXMLPathCursor>( kkXMLPathCursor( std::move( branches ) ) );
+	}
 	kkArray<kkXMLNode*> SelectNodes(const kkXMLString& XPath_expression ){
 #ifdef GAME_TOOL
 		kkArray<kkXMLNode*> a = kkArray<kkXMLNode*>(0xff);
 #else
 		kkArray<kkXMLNode*> a;
 #endif
-		if( !m_isInit ){
-			fprintf( stderr, "Bad kkXMLDocument\n" );
-			return a;
-		}
-		std::vector<kkXPathToken> XPathTokens;
-		if( !XPathGetTokens( &XPathTokens, XPath_expression ) ){
-			fprintf( stderr, "Bad XPath expression\n" );
-			return a;
+		SelectNodes( XPath_expression, a );
+		return a;
+	}
+	// Same as above, but fills caller's array. `a` is cleared, capacity is kept,
+	// so calling it in a loop with the same array does not allocate.
+	// Bad expression returns false with kkXMLErrorCode::BadXPath in GetError().
+	bool SelectNodes(const kkXMLString& XPath_expression, kkArray<kkXMLNode*>& a ){
+		kkXMLStatsTime( m_stats, kkXMLParsePhase::Select );
+		a.clear();
+		if( !m_isInit ) return false; // not read, GetError() tells why
+		if( xmlutil::XPathFindUnion( XPath_expression, 0 ) == XPath_expression.size() ){
+			if( !selectPath( XPath_expression, a ) ) return false;
+		}else{
+			size_t pos = 0;
+			while( xmlutil::XPathNextUnionPart( XPath_expression, pos, m_XPathPart ) ){
+				if( !m_XPathPart.size() ) return xmlutil::XPathError( &m_error, XPath_expression, u"path", pos - 1 );
+				if( !selectPath( m_XPathPart, a ) ) return false;
+			}
+			SortDocumentOrder( a );
 		}
-		kkArray<kkXMLString*> elements;
-		unsigned int next = 0;
-		unsigned int sz = (unsigned int)XPathTokens.size();
-		for( unsigned int i = 0; i < sz; ++i ){
-			next = i + 1;
-			if( i == 0 ){
-				if( XPathTokens[ i ].m_type != kkXPathTokenType::Slash && XPathTokens[ i ].m_type != kkXPathTokenType::Double_slash){
-					fwprintf( stderr, L"Bad XPath expression \"%s\". Expression must begin with `/`\n", (const wchar_t*)XPath_expression.data() );
-					return a;
-				}
+		kkXMLStatsAdd( m_stats, m_selected, a.size() );
+		return true;
+	}
+	// XPath functions count, sum, min, max, boolean and string of one path:
+	//	count(/Root/Item), sum(//Item/@price), string(//Item[@id='x']/@name)
+	// Values are reduced while nodes are found, no node array is made;
+	// boolean and string stop at the first node. Value of an element is its
+	// text. sum, min and max are NaN if any value is not a number, min and
+	// max of no nodes are NaN.
+	// Union `count(/a | //b)` is collected and sorted first; all its paths
+	// must end with the same `/@attribute`, or none.
+	bool Evaluate( const kkXMLString& XPath_expression, kkXPathValue& out ){
+		kkXMLStatsTime( m_stats, kkXMLParsePhase::Select );
+		out.clear();
+		if( !m_isInit ) return false;
+		kkXPathFunction function;
+		if( !xmlutil::XPathGetFunction( XPath_expression, function, m_XPathUnion, m_XPathAttribute, &m_error ) )
+			return false;
+		bool isUnion = xmlutil::XPathFindUnion( m_XPathUnion, 0 ) != m_XPathUnion.size();
+		if( isUnion ){
+			m_XPathNodes.clear();
+			size_t pos = 0;
+			while( xmlutil::XPathNextUnionPart( m_XPathUnion, pos, m_XPathPart ) ){
+				if( !m_XPathPart.size() ) return xmlutil::XPathError( &m_error, XPath_expression, u"path" );
+				if( !xmlutil::XPathSplitAttribute( m_XPathPart, m_XPathPartAttribute ) )
+					return xmlutil::XPathError( &m_error, XPath_expression, u"attribute name" );
+				// last path has its attribute split off already
+				if( pos <= m_XPathUnion.size() && m_XPathPartAttribute != m_XPathAttribute )
+					return xmlutil::XPathError( &m_error, XPath_expression, u"same /@attribute in all paths of union" );
+				if( !selectPath( m_XPathPart, m_XPathNodes ) ) return false;
 			}
-			switch( XPathTokens[ i ].m_type ){
-				case kkXPathTokenType::Slash:
-				if( next >= sz ){
-					fprintf( stderr, "Bad XPath expression\n" );
-					return a;
-				}
-				if( XPathTokens[ next ].m_type == kkXPathTokenType::Name ){
-					elements.push_back( &XPathTokens[ next ].m_string );
-					++i;
-				}else{
-					fwprintf( stderr, L"Bad XPath expression \"%s\". Expected XML element name\n", (const wchar_t*)XPath_expression.data() );
-					return a;
-				}
-				break;
-				case kkXPathTokenType::Double_slash:
-				break;
-				case kkXPathTokenType::Name:
-				break;
-				case kkXPathTokenType::Equal:
-				break;
-				case kkXPathTokenType::Not_equal:
-				break;
-				case kkXPathTokenType::More:
-				break;
-				case kkXPathTokenType::Less:
-				break;
-				case kkXPathTokenType::More_eq:
-				break;
-				case kkXPathTokenType::Less_eq:
-				break;
-				case kkXPathTokenType::Apos:
-				break;
-				case kkXPathTokenType::Number:
-				break;
-				case kkXPathTokenType::Comma:
-				break;
-				case kkXPathTokenType::Function:
-				break;
-				case kkXPathTokenType::Function_open:
-				break;
-				case kkXPathTokenType::Function_close:
-				break;
-				case kkXPathTokenType::Attribute:
-				break;
-				case kkXPathTokenType::Bit_or:
-				break;
-				case kkXPathTokenType::Sq_open:
-				break;
-				case kkXPathTokenType::Sq_close:
-				break;
-				case kkXPathTokenType::Div:
-				break;
-				case kkXPathTokenType::Mod:
-				break;
-				case kkXPathTokenType::Add:
-				break;
-				case kkXPathTokenType::Sub:
-				break;
-				case kkXPathTokenType::Mul:
-				break;
-				case kkXPathTokenType::And:
-				break;
-				case kkXPathTokenType::Or:
-				break;
-				case kkXPathTokenType::Axis_namespace:
-				break;
-				case kkXPathTokenType::Axis:
-				break;
-				case kkXPathTokenType::NONE:
-				break;
+			SortDocumentOrder( m_XPathNodes );
+		}else if( !xmlutil::XPathGetPath( m_XPathUnion, m_XPathTokens, m_XPathElements, &m_error ) )
+			return false;
+		const double nan = std::numeric_limits<double>::quiet_NaN();
+		const kkXMLString& attribute = m_XPathAttribute;
+		size_t count = 0;
+		double result = function == kkXPathFunction::Sum ? 0.0 : nan;
+		auto reduce = [&]( kkXMLNode* node ){
+			const kkXMLString* value = &node->text;
+			if( attribute.size() ){
+				kkXMLAttribute* a = node->getAttribute( attribute );
+				if( !a ) return true;
+				value = &a->value;
 			}
+			++count;
+			if( function == kkXPathFunction::Count ) return true;
+			if( function == kkXPathFunction::Boolean ) return false;
+			if( function == kkXPathFunction::String ){
+				out.string = *value;
+				return false;
+			}
+			double d;
+			if( !xmlutil::parseValue( *value, d ) ) d = nan;
+			if( function == kkXPathFunction::Sum ) result += d;
+			else if( count == 1 || d != d ) result = d;
+			else if( function == kkXPathFunction::Min ? d < result : d > result ) result = d;
+			return true;
+		};
+		if( isUnion ){
+			for( kkXMLNode* node : m_XPathNodes )
+				if( !reduce( node ) ) break;
+		}else XPathForEach( m_XPathElements, reduce );
+		switch( function ){
+			case kkXPathFunction::Count:
+			out.number = (double)count;
+			break;
+			case kkXPathFunction::Boolean:
+			out.type = kkXPathValueType::Boolean;
+			out.boolean = count != 0;
+			break;
+			case kkXPathFunction::String:
+			out.type = kkXPathValueType::String;
+			break;
+			default:
+			out.number = result;
+			break;
 		}
-		if( elements.size() ){
-			sz = (unsigned int)elements.size();
-			XPathGetNodes( 0, sz - 1, elements, &m_root, &a );
-		}
-		return a;
+		return true;
+	}
+private:
+	// Cursor of one path, empty one without m_root if it is bad.
+	kkXMLPathCursor selectCursor( const kkXMLString& XPath_expression ){
+		if( !m_isInit || !xmlutil::XPathGetPath( XPath_expression, m_XPathTokens, m_XPathElements, &m_error ) )
+			return kkXMLPathCursor();
+		auto path = std::make_shared<kkArray<kkXPathToken>>();
+		size_t sz = m_XPathElements.size();
+		for( size_t i = 0; i < sz; ++i ) path->push_back( *m_XPathElements[ i ] );
+		return kkXMLPathCursor( &m_root, path );
+	}
+	// Appends nodes of one path to `a`.
+	bool selectPath( const kkXMLString& XPath_expression, kkArray<kkXMLNode*>& a ){
+		if( !xmlutil::XPathGetPath( XPath_expression, m_XPathTokens, m_XPathElements, &m_error ) )
+			return false;
+		XPathForEach( m_XPathElements, [&a]( kkXMLNode* node ){
+			a.push_back( node );
+			return true;
+		});
+		return true;
 	}
 };
+typedef kkXMLDocumentT<kkXMLDefaultPolicy> kkXMLDocument;
 
 #endif